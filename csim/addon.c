@@ -0,0 +1,534 @@
+//
+// Node.js addon which runs the simulation in-process (build with
+// 'make numbersim.node'). Example:
+//
+//     const numbersim = require('./csim/numbersim.node');
+//     let r = numbersim.run({
+//         languagesFile: __dirname + '/languages.txt',
+//         language: 'a_sing:pl',
+//         seed1: 2000, seed2: 3000,
+//         learningRate: 0.01,
+//         maxCue: 7,
+//         nTrials: 1000,
+//         mode: 'aggregate',
+//         quitAfterNCorrect: 0,
+//         distribution: new Float64Array([0.3, 0.2, 0.15, 0.1, 0.1, 0.05]),
+//         firstRun: 0, lastRun: 999
+//     });
+//
+// runAsync() takes the same options and returns a Promise of the same result.
+// Its runs are simulated on the libuv thread pool.
+//
+// The options correspond to numbersim's arguments. seed1 and seed2 may be
+// Numbers or BigInts. If firstRun is given, runs firstRun to lastRun
+// (default firstRun) of the partitioned stream are simulated, as for a first
+// seed argument of the form 'SEED:I-J'. The 'full' mode is not supported.
+//
+// The result has the following properties, where n_columns is maxCue + 1 and
+// the last column of each run is for all cardinalities together:
+//
+//     runs                 Number of runs.
+//     trialsToCriterion    ('summary' mode) BigUint64Array of n_columns
+//                          values per run, exactly as output by numbersim.
+//     correct              ('range_summary' mode) Uint8Array of nTrials
+//                          values per column per run. 1 if the run got that
+//                          column right at that trial, 0 otherwise.
+//     counts               ('aggregate' mode) BigUint64Array of nTrials values
+//                          per column giving the number of runs which got that
+//                          column right at that trial.
+//     randStates           ('summary' and 'range_summary' modes) BigUint64Array
+//                          of the final random number generator state and
+//                          increment of each run.
+//
+
+#define NAPI_VERSION 6
+#include <node_api.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <config.h>
+#include <libnumbersim.h>
+
+#define MAX_STRING_OPTION_LENGTH 4096
+
+typedef struct job {
+    // NULL until initialized.
+    ns_state_t *state;
+    uint64_t first_run, n_runs;
+    uint_fast64_t n_trials;
+    unsigned n_columns;
+
+    uint64_t *trials_to_criterion;
+    uint8_t *correct;
+    uint64_t *counts;
+    uint64_t *rand_states;
+
+    napi_async_work work;
+    napi_deferred deferred;
+} job_t;
+
+static void free_job(job_t *job)
+{
+    ns_state_free(job->state);
+    free(job->trials_to_criterion);
+    free(job->correct);
+    free(job->counts);
+    free(job->rand_states);
+    free(job);
+}
+
+//
+// Option parsing. Each function returns false with a pending JS exception on
+// error.
+//
+
+static bool get_option(napi_env env, napi_value options, const char *name, bool required, napi_value *value)
+{
+    bool has;
+    if (napi_has_named_property(env, options, name, &has) != napi_ok)
+        return false;
+    if (! has) {
+        *value = NULL;
+        if (required) {
+            char msg[128];
+            snprintf(msg, sizeof(msg), "Missing option '%s'", name);
+            napi_throw_type_error(env, NULL, msg);
+            return false;
+        }
+        return true;
+    }
+    return napi_get_named_property(env, options, name, value) == napi_ok;
+}
+
+static bool get_double_option(napi_env env, napi_value options, const char *name, double *d)
+{
+    napi_value v;
+    if (! get_option(env, options, name, true, &v))
+        return false;
+    if (napi_get_value_double(env, v, d) != napi_ok) {
+        char msg[128];
+        snprintf(msg, sizeof(msg), "Option '%s' must be a number", name);
+        napi_throw_type_error(env, NULL, msg);
+        return false;
+    }
+    return true;
+}
+
+// Accepts either a Number or a BigInt.
+static bool get_uint64_option(napi_env env, napi_value options, const char *name, bool required, uint64_t *u)
+{
+    napi_value v;
+    if (! get_option(env, options, name, required, &v))
+        return false;
+    if (! v)
+        return true;
+
+    napi_valuetype type;
+    napi_typeof(env, v, &type);
+    if (type == napi_bigint) {
+        bool lossless;
+        if (napi_get_value_bigint_uint64(env, v, u, &lossless) == napi_ok && lossless)
+            return true;
+    }
+    else if (type == napi_number) {
+        double d;
+        napi_get_value_double(env, v, &d);
+        if (d >= 0 && d < 18446744073709551616.0 && d == (double)(uint64_t)d) {
+            *u = (uint64_t)d;
+            return true;
+        }
+    }
+
+    char msg[128];
+    snprintf(msg, sizeof(msg), "Option '%s' must be a non-negative integer", name);
+    napi_throw_type_error(env, NULL, msg);
+    return false;
+}
+
+static bool get_string_option(napi_env env, napi_value options, const char *name, char *buf, size_t bufsize)
+{
+    napi_value v;
+    if (! get_option(env, options, name, true, &v))
+        return false;
+    size_t len;
+    if (napi_get_value_string_utf8(env, v, buf, bufsize, &len) != napi_ok) {
+        char msg[128];
+        snprintf(msg, sizeof(msg), "Option '%s' must be a string", name);
+        napi_throw_type_error(env, NULL, msg);
+        return false;
+    }
+    if (len + 1 >= bufsize) {
+        char msg[128];
+        snprintf(msg, sizeof(msg), "Option '%s' is too long", name);
+        napi_throw_range_error(env, NULL, msg);
+        return false;
+    }
+    return true;
+}
+
+static job_t *parse_job(napi_env env, napi_value options)
+{
+    // The context holding the language table belongs to this instance of the
+    // addon (see init()), so it is only ever used from one JS thread.
+    ns_context_t *ctx;
+    if (napi_get_instance_data(env, (void **)&ctx) != napi_ok || ! ctx) {
+        napi_throw_error(env, NULL, "numbersim addon not initialized");
+        return NULL;
+    }
+
+    job_t *job = calloc(1, sizeof(job_t));
+    if (! job) {
+        napi_throw_range_error(env, NULL, "Not enough memory for results");
+        return NULL;
+    }
+
+    ns_config_t config;
+    char languages_file[MAX_STRING_OPTION_LENGTH];
+    char language_name[MAX_STRING_OPTION_LENGTH];
+    char mode[MAX_STRING_OPTION_LENGTH];
+    uint64_t max_cue, quit_after_n_correct;
+    if (! get_string_option(env, options, "languagesFile", languages_file, sizeof(languages_file)) ||
+        ! get_string_option(env, options, "language", language_name, sizeof(language_name)) ||
+        ! get_uint64_option(env, options, "seed1", true, &(config.seed1)) ||
+        ! get_uint64_option(env, options, "seed2", true, &(config.seed2)) ||
+        ! get_double_option(env, options, "learningRate", &(config.learning_rate)) ||
+        ! get_uint64_option(env, options, "maxCue", true, &max_cue) ||
+        ! get_uint64_option(env, options, "nTrials", true, &(config.n_trials)) ||
+        ! get_string_option(env, options, "mode", mode, sizeof(mode)) ||
+        ! get_uint64_option(env, options, "quitAfterNCorrect", true, &quit_after_n_correct)) {
+        goto err;
+    }
+    config.language_file = languages_file;
+    config.language = language_name;
+
+    if (max_cue == 0 || max_cue > MAX_CARDINALITY) {
+        napi_throw_range_error(env, NULL, "Bad value for maxCue");
+        goto err;
+    }
+    if (quit_after_n_correct > UINT32_MAX) {
+        napi_throw_range_error(env, NULL, "Bad value for quitAfterNCorrect");
+        goto err;
+    }
+    config.max_cue = max_cue;
+    config.quit_after_n_correct = quit_after_n_correct;
+    job->n_trials = config.n_trials;
+    job->n_columns = max_cue + 1;
+
+    if (! strcmp(mode, "summary")) {
+        config.output_mode = NS_OUTPUT_MODE_SUMMARY;
+    }
+    else if (! strcmp(mode, "range_summary")) {
+        config.output_mode = NS_OUTPUT_MODE_RANGE_SUMMARY;
+    }
+    else if (! strcmp(mode, "aggregate")) {
+        config.output_mode = NS_OUTPUT_MODE_AGGREGATE;
+    }
+    else {
+        napi_throw_range_error(env, NULL, "Bad value for mode (should be \"summary\", \"range_summary\" or \"aggregate\")");
+        goto err;
+    }
+
+    uint64_t last_run;
+    napi_value first_run_value;
+    if (! get_option(env, options, "firstRun", false, &first_run_value))
+        goto err;
+    config.partitioned = first_run_value != NULL;
+    if (config.partitioned) {
+        if (! get_uint64_option(env, options, "firstRun", true, &(job->first_run)))
+            goto err;
+        last_run = job->first_run;
+        if (! get_uint64_option(env, options, "lastRun", false, &last_run))
+            goto err;
+        if (last_run < job->first_run) {
+            napi_throw_range_error(env, NULL, "lastRun must not be less than firstRun");
+            goto err;
+        }
+        if (last_run > MAX_PARTITIONED_RUN) {
+            napi_throw_range_error(env, NULL, "lastRun is too big (max is 2^24 - 1)");
+            goto err;
+        }
+        job->n_runs = last_run - job->first_run + 1;
+    }
+    else {
+        job->n_runs = 1;
+    }
+
+    napi_value dist;
+    if (! get_option(env, options, "distribution", true, &dist))
+        goto err;
+    bool is_typedarray;
+    napi_is_typedarray(env, dist, &is_typedarray);
+    napi_typedarray_type dist_type;
+    size_t dist_length;
+    void *dist_data;
+    if (! is_typedarray ||
+        napi_get_typedarray_info(env, dist, &dist_type, &dist_length, &dist_data, NULL, NULL) != napi_ok ||
+        dist_type != napi_float64_array) {
+        napi_throw_type_error(env, NULL, "Option 'distribution' must be a Float64Array");
+        goto err;
+    }
+    if (dist_length != max_cue - 1) {
+        char msg[128];
+        snprintf(msg, sizeof(msg), "Incorrect number of p values for probability distribution (%zu given, %u required)", dist_length, (unsigned)max_cue - 1);
+        napi_throw_range_error(env, NULL, msg);
+        goto err;
+    }
+    config.distribution = (const double *)dist_data;
+
+    if (ns_state_new(ctx, &config, &(job->state)) != NS_OK) {
+        napi_throw_error(env, NULL, ns_context_error(ctx));
+        goto err;
+    }
+
+    // Allocate result buffers up front so that the (possibly off-thread)
+    // simulation never has to fail.
+    size_t per_run = job->n_columns * job->n_trials;
+    if (config.output_mode == NS_OUTPUT_MODE_SUMMARY) {
+        job->trials_to_criterion = malloc(job->n_runs * job->n_columns * sizeof(uint64_t));
+        job->rand_states = malloc(job->n_runs * 2 * sizeof(uint64_t));
+    }
+    else if (config.output_mode == NS_OUTPUT_MODE_RANGE_SUMMARY) {
+        job->correct = calloc(job->n_runs * per_run, sizeof(uint8_t));
+        job->rand_states = malloc(job->n_runs * 2 * sizeof(uint64_t));
+    }
+    else {
+        job->counts = calloc(per_run, sizeof(uint64_t));
+    }
+    if ((config.output_mode == NS_OUTPUT_MODE_SUMMARY && ! job->trials_to_criterion) ||
+        (config.output_mode == NS_OUTPUT_MODE_RANGE_SUMMARY && ! job->correct) ||
+        (config.output_mode == NS_OUTPUT_MODE_AGGREGATE && ! job->counts) ||
+        (config.output_mode != NS_OUTPUT_MODE_AGGREGATE && ! job->rand_states)) {
+        napi_throw_range_error(env, NULL, "Not enough memory for results");
+        goto err;
+    }
+
+    return job;
+
+err:
+    free_job(job);
+    return NULL;
+}
+
+//
+// Simulation. Doesn't call into JS, so safe to run on the thread pool.
+//
+
+static void record_run(job_t *job, uint64_t run_index)
+{
+    const ns_state_t *state = job->state;
+
+    if (job->trials_to_criterion) {
+        ns_trials_to_criterion(state, job->trials_to_criterion + (run_index * job->n_columns));
+    }
+    else if (job->correct) {
+        uint8_t *correct = job->correct + (run_index * job->n_columns * job->n_trials);
+        for (unsigned i = 0; i < job->n_columns; ++i) {
+            for (uint_fast64_t j = 0; j < ns_trials_run(state); ++j)
+                correct[(i * job->n_trials) + j] = ns_was_correct_at(state, i, j);
+        }
+    }
+    else {
+        ns_add_correct_counts(state, job->counts);
+    }
+
+    if (job->rand_states) {
+        ns_rand_state(state, job->rand_states + (run_index * 2), job->rand_states + (run_index * 2) + 1);
+    }
+}
+
+static void run_job(job_t *job)
+{
+    for (uint64_t r = 0; r < job->n_runs; ++r) {
+        ns_start_run(job->state, job->first_run + r);
+        ns_run(job->state, NULL, NULL);
+        record_run(job, r);
+    }
+}
+
+//
+// Conversion of results to JS.
+//
+
+static napi_value make_typed_array(napi_env env, napi_typedarray_type type, const void *data, size_t length, size_t element_size)
+{
+    napi_value buffer, array;
+    void *buffer_data;
+    if (napi_create_arraybuffer(env, length * element_size, &buffer_data, &buffer) != napi_ok)
+        return NULL;
+    if (length > 0)
+        memcpy(buffer_data, data, length * element_size);
+    if (napi_create_typedarray(env, type, length, buffer, 0, &array) != napi_ok)
+        return NULL;
+    return array;
+}
+
+static napi_value make_result(napi_env env, const job_t *job)
+{
+    napi_value result, runs, array = NULL, rand_states = NULL;
+    const char *name;
+
+    if (napi_create_object(env, &result) != napi_ok ||
+        napi_create_double(env, (double)job->n_runs, &runs) != napi_ok ||
+        napi_set_named_property(env, result, "runs", runs) != napi_ok) {
+        return NULL;
+    }
+
+    if (job->trials_to_criterion) {
+        name = "trialsToCriterion";
+        array = make_typed_array(env, napi_biguint64_array, job->trials_to_criterion, job->n_runs * job->n_columns, sizeof(uint64_t));
+    }
+    else if (job->correct) {
+        name = "correct";
+        array = make_typed_array(env, napi_uint8_array, job->correct, job->n_runs * job->n_columns * job->n_trials, sizeof(uint8_t));
+    }
+    else {
+        name = "counts";
+        array = make_typed_array(env, napi_biguint64_array, job->counts, job->n_columns * job->n_trials, sizeof(uint64_t));
+    }
+    if (! array || napi_set_named_property(env, result, name, array) != napi_ok)
+        return NULL;
+
+    if (job->rand_states) {
+        rand_states = make_typed_array(env, napi_biguint64_array, job->rand_states, job->n_runs * 2, sizeof(uint64_t));
+        if (! rand_states || napi_set_named_property(env, result, "randStates", rand_states) != napi_ok)
+            return NULL;
+    }
+
+    return result;
+}
+
+//
+// Exported functions.
+//
+
+static napi_value get_options_argument(napi_env env, napi_callback_info info)
+{
+    size_t argc = 1;
+    napi_value argv[1];
+    napi_valuetype type;
+    if (napi_get_cb_info(env, info, &argc, argv, NULL, NULL) != napi_ok)
+        return NULL;
+    if (argc < 1 || napi_typeof(env, argv[0], &type) != napi_ok || type != napi_object) {
+        napi_throw_type_error(env, NULL, "Expected an options object");
+        return NULL;
+    }
+    return argv[0];
+}
+
+static napi_value run(napi_env env, napi_callback_info info)
+{
+    napi_value options = get_options_argument(env, info);
+    if (! options)
+        return NULL;
+    job_t *job = parse_job(env, options);
+    if (! job)
+        return NULL;
+
+    run_job(job);
+    napi_value result = make_result(env, job);
+    free_job(job);
+    return result;
+}
+
+static void execute_async(napi_env env, void *data)
+{
+    run_job((job_t *)data);
+}
+
+static void complete_async(napi_env env, napi_status status, void *data)
+{
+    job_t *job = (job_t *)data;
+
+    napi_value result = NULL;
+    if (status == napi_ok)
+        result = make_result(env, job);
+
+    if (result) {
+        napi_resolve_deferred(env, job->deferred, result);
+    }
+    else {
+        napi_value error, msg;
+        bool pending;
+        napi_is_exception_pending(env, &pending);
+        if (pending) {
+            napi_get_and_clear_last_exception(env, &error);
+        }
+        else {
+            napi_create_string_utf8(env, "Simulation failed", NAPI_AUTO_LENGTH, &msg);
+            napi_create_error(env, NULL, msg, &error);
+        }
+        napi_reject_deferred(env, job->deferred, error);
+    }
+
+    napi_delete_async_work(env, job->work);
+    free_job(job);
+}
+
+static napi_value run_async(napi_env env, napi_callback_info info)
+{
+    napi_value promise;
+    napi_deferred deferred;
+    if (napi_create_promise(env, &deferred, &promise) != napi_ok)
+        return NULL;
+
+    // Bad options reject the promise rather than throwing.
+    job_t *job = NULL;
+    napi_value options = get_options_argument(env, info);
+    if (options)
+        job = parse_job(env, options);
+    if (! job) {
+        napi_value error;
+        napi_get_and_clear_last_exception(env, &error);
+        napi_reject_deferred(env, deferred, error);
+        return promise;
+    }
+    job->deferred = deferred;
+
+    napi_value resource_name;
+    napi_create_string_utf8(env, "numbersim.runAsync", NAPI_AUTO_LENGTH, &resource_name);
+    if (napi_create_async_work(env, NULL, resource_name, execute_async, complete_async, job, &(job->work)) != napi_ok) {
+        job->work = NULL;
+    }
+    else if (napi_queue_async_work(env, job->work) != napi_ok) {
+        napi_delete_async_work(env, job->work);
+        job->work = NULL;
+    }
+    if (! job->work) {
+        napi_value error, msg;
+        napi_create_string_utf8(env, "Could not queue simulation", NAPI_AUTO_LENGTH, &msg);
+        napi_create_error(env, NULL, msg, &error);
+        napi_reject_deferred(env, deferred, error);
+        free_job(job);
+    }
+
+    return promise;
+}
+
+static void free_context(napi_env env, void *data, void *hint)
+{
+    ns_context_free((ns_context_t *)data);
+}
+
+static napi_value init(napi_env env, napi_value exports)
+{
+    // Each instance of the addon (e.g. in each worker thread) has its own
+    // table of languages.
+    ns_context_t *ctx = ns_context_new();
+    if (! ctx || napi_set_instance_data(env, ctx, free_context, NULL) != napi_ok) {
+        ns_context_free(ctx);
+        napi_throw_error(env, NULL, "Could not initialize numbersim addon");
+        return NULL;
+    }
+
+    napi_property_descriptor props[] = {
+        { "run", NULL, run, NULL, NULL, NULL, napi_enumerable, NULL },
+        { "runAsync", NULL, run_async, NULL, NULL, NULL, napi_enumerable, NULL }
+    };
+    if (napi_define_properties(env, exports, sizeof(props)/sizeof(props[0]), props) != napi_ok)
+        return NULL;
+    return exports;
+}
+
+NAPI_MODULE(numbersim, init)
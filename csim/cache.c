@@ -0,0 +1,225 @@
+#include <cache.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#define FNV1A_64_PRIME 1099511628211ULL
+
+uint64_t fnv1a_64(uint64_t hash, const void *data, size_t size)
+{
+    const unsigned char *bytes = data;
+    for (size_t i = 0; i < size; ++i) {
+        hash ^= bytes[i];
+        hash *= FNV1A_64_PRIME;
+    }
+    return hash;
+}
+
+struct cache {
+    char directory[PATH_MAX];
+    uint64_t max_bytes;
+    // Total size of the entries, counted when the cache is opened and then
+    // kept up to date as entries are added, so that the directory only has to
+    // be scanned when the cache is full. Entries added by other processes are
+    // only counted at the next scan.
+    uint64_t total_bytes;
+    // Entry currently being written by cache_begin()/cache_commit().
+    char tmp_path[PATH_MAX];
+    char entry_path[PATH_MAX];
+    long header_size;
+};
+
+// Temporary entry to delete if the process exits before it is committed
+// (e.g. because of a bad request).
+static const char *pending_tmp_path;
+
+static void remove_pending_entry(void)
+{
+    if (pending_tmp_path)
+        unlink(pending_tmp_path);
+}
+
+static void entry_path(const cache_t *cache, const char *key, char *path)
+{
+    uint64_t hash = fnv1a_64(FNV1A_64_INIT, key, strlen(key));
+    snprintf(path, PATH_MAX, "%s/%016llx.out", cache->directory, (unsigned long long)hash);
+}
+
+typedef struct entry {
+    char name[NAME_MAX+1];
+    uint64_t size;
+    struct timespec mtime;
+} entry_t;
+
+static int compare_entry_mtimes(const void *a, const void *b)
+{
+    const struct timespec *x = &((const entry_t *)a)->mtime, *y = &((const entry_t *)b)->mtime;
+    if (x->tv_sec != y->tv_sec)
+        return (x->tv_sec > y->tv_sec) - (x->tv_sec < y->tv_sec);
+    return (x->tv_nsec > y->tv_nsec) - (x->tv_nsec < y->tv_nsec);
+}
+
+// Lists the entries in the cache directory, returning their total size. The
+// caller must free the list. If 'entries' is NULL, the sizes are just added up.
+static uint64_t list_entries(const cache_t *cache, entry_t **entries, size_t *n_entries)
+{
+    uint64_t total = 0;
+    size_t capacity = 0;
+    if (entries) {
+        *entries = NULL;
+        *n_entries = 0;
+    }
+
+    DIR *dir = opendir(cache->directory);
+    if (! dir)
+        return 0;
+    char path[PATH_MAX];
+    struct dirent *de;
+    while ((de = readdir(dir))) {
+        size_t len = strlen(de->d_name);
+        if (len < 4 || strcmp(de->d_name + len - 4, ".out"))
+            continue;
+        snprintf(path, PATH_MAX, "%s/%s", cache->directory, de->d_name);
+        struct stat st;
+        if (stat(path, &st) != 0)
+            continue;
+        total += st.st_size;
+        if (! entries)
+            continue;
+        if (*n_entries == capacity) {
+            capacity = capacity ? capacity * 2 : 256;
+            entry_t *e = realloc(*entries, capacity * sizeof(entry_t));
+            if (! e)
+                break;
+            *entries = e;
+        }
+        entry_t *e = *entries + (*n_entries)++;
+        strcpy(e->name, de->d_name);
+        e->size = st.st_size;
+        e->mtime = st.st_mtim;
+    }
+    closedir(dir);
+    return total;
+}
+
+// Deletes least recently used entries until the cache is within its size
+// limit, with an eighth of the limit to spare so that the directory isn't
+// scanned again on the next few commits.
+static void evict(cache_t *cache)
+{
+    entry_t *entries;
+    size_t n_entries;
+    cache->total_bytes = list_entries(cache, &entries, &n_entries);
+
+    uint64_t target = cache->max_bytes - (cache->max_bytes / 8);
+    if (cache->total_bytes > cache->max_bytes) {
+        char path[PATH_MAX];
+        qsort(entries, n_entries, sizeof(entry_t), compare_entry_mtimes);
+        for (size_t i = 0; i < n_entries && cache->total_bytes > target; ++i) {
+            snprintf(path, PATH_MAX, "%s/%s", cache->directory, entries[i].name);
+            if (unlink(path) == 0)
+                cache->total_bytes -= entries[i].size;
+        }
+    }
+    free(entries);
+}
+
+cache_t *cache_open(const char *directory, uint64_t max_bytes)
+{
+    if (strlen(directory) + 32 >= PATH_MAX)
+        return NULL;
+    if (mkdir(directory, 0777) != 0 && errno != EEXIST)
+        return NULL;
+    struct stat st;
+    if (stat(directory, &st) != 0 || ! S_ISDIR(st.st_mode))
+        return NULL;
+
+    cache_t *cache = malloc(sizeof(cache_t));
+    if (! cache)
+        return NULL;
+    strcpy(cache->directory, directory);
+    cache->max_bytes = max_bytes;
+    cache->total_bytes = list_entries(cache, NULL, NULL);
+    snprintf(cache->tmp_path, PATH_MAX, "%s/tmp.%ld", directory, (long)getpid());
+    atexit(remove_pending_entry);
+    return cache;
+}
+
+static void copy_rest(FILE *from, FILE *to)
+{
+    char buf[1 << 16];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), from)) > 0)
+        fwrite(buf, 1, n, to);
+}
+
+bool cache_fetch(cache_t *cache, const char *key, FILE *out)
+{
+    char path[PATH_MAX];
+    entry_path(cache, key, path);
+    FILE *f = fopen(path, "r");
+    if (! f)
+        return false;
+
+    char *line = NULL;
+    size_t sz = 0;
+    ssize_t len = getline(&line, &sz, f);
+    bool hit = len > 0 && line[len-1] == '\n' && (size_t)(len - 1) == strlen(key) && ! strncmp(line, key, len - 1);
+    free(line);
+    if (hit) {
+        copy_rest(f, out);
+        // Mark as recently used.
+        utimensat(AT_FDCWD, path, NULL, 0);
+    }
+    fclose(f);
+    return hit;
+}
+
+FILE *cache_begin(cache_t *cache, const char *key)
+{
+    FILE *f = fopen(cache->tmp_path, "w+");
+    if (! f)
+        return NULL;
+    pending_tmp_path = cache->tmp_path;
+    entry_path(cache, key, cache->entry_path);
+    fprintf(f, "%s\n", key);
+    cache->header_size = strlen(key) + 1;
+    return f;
+}
+
+void cache_commit(cache_t *cache, FILE *f, FILE *out)
+{
+    bool ok = fflush(f) == 0;
+    long size = ftell(f);
+    fseek(f, cache->header_size, SEEK_SET);
+    copy_rest(f, out);
+    ok = ! ferror(f) && fclose(f) == 0 && ok;
+
+    // An entry with the same name (left by a hash collision, or written by
+    // another process) is replaced.
+    struct stat old;
+    uint64_t old_size = stat(cache->entry_path, &old) == 0 ? (uint64_t)old.st_size : 0;
+    if (ok && size >= 0 && (uint64_t)size <= cache->max_bytes && rename(cache->tmp_path, cache->entry_path) == 0) {
+        pending_tmp_path = NULL;
+        cache->total_bytes += size;
+        cache->total_bytes -= old_size < cache->total_bytes ? old_size : cache->total_bytes;
+        if (cache->total_bytes > cache->max_bytes)
+            evict(cache);
+    }
+    else {
+        unlink(cache->tmp_path);
+        pending_tmp_path = NULL;
+    }
+}
+
+void cache_abort(cache_t *cache, FILE *f)
+{
+    fclose(f);
+    unlink(cache->tmp_path);
+    pending_tmp_path = NULL;
+}
@@ -0,0 +1,43 @@
+//
+// On-disk cache of numbersim output, used when the NUMBERSIM_CACHE
+// environment variable is set to a directory.
+//
+// Entries are addressed by a hash of a key string which describes everything
+// the output of a request depends on. Each entry is a file named after the
+// hash, holding the key on its first line followed by the output. The key is
+// compared on lookup, so a hash collision is just a miss. When the total size
+// of the entries exceeds the limit, the least recently used ones are deleted
+// until an eighth of the limit is free.
+//
+// The cache is best effort. If an entry can't be read or written, the request
+// is run as if there were no cache.
+//
+
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#define FNV1A_64_INIT 14695981039346656037ULL
+
+uint64_t fnv1a_64(uint64_t hash, const void *data, size_t size);
+
+typedef struct cache cache_t;
+
+// Returns NULL if the directory can't be created.
+cache_t *cache_open(const char *directory, uint64_t max_bytes);
+// If there is an entry for 'key', copies it to 'out' and returns true.
+bool cache_fetch(cache_t *cache, const char *key, FILE *out);
+// Returns a file to write the output for 'key' to, or NULL if the entry can't
+// be created.
+FILE *cache_begin(cache_t *cache, const char *key);
+// Closes the file returned by cache_begin(), copies the output to 'out' and
+// stores it in the cache.
+void cache_commit(cache_t *cache, FILE *f, FILE *out);
+// Closes the file returned by cache_begin() without storing anything.
+void cache_abort(cache_t *cache, FILE *f);
+
+#endif
@@ -6,5 +6,25 @@
 #define MARKER_MAX_LENGTH 10
 #define MAX_MARKERS 10
 #define MAX_CARDINALITY 10
+// Number of random numbers between the starts of consecutive runs of a
+// partitioned stream. Each trial uses one random number, so this is also the
+// maximum number of trials in such a run.
+#define RUN_STREAM_STRIDE (1ULL << 40)
+// Highest run index of a partitioned stream. The offset of a later run would
+// wrap around the 64-bit generator state and repeat the stream of an earlier
+// run.
+#define MAX_PARTITIONED_RUN (~0ULL / RUN_STREAM_STRIDE)
+// Default number of runs added at a time by aggregate mode's stopping rule.
+#define ENSEMBLE_BLOCK_SIZE 50
+// Part of every cache key. Increment this whenever a change to the simulation
+// changes its output, so that old results in caches are no longer used.
+#define CACHE_FORMAT_VERSION 2
+#define CACHE_DEFAULT_MAX_MB 1024
+// Maximum number of clients connected to the daemon at once, and maximum length
+// of a line sent by a client.
+#define DAEMON_MAX_CLIENTS 256
+#define DAEMON_MAX_LINE_LENGTH (1024*8)
+// How long a stopping daemon waits for clients to read their last responses.
+#define DAEMON_SHUTDOWN_TIMEOUT_MS 5000
 
 #endif
@@ -0,0 +1,640 @@
+#include <daemon.h>
+#include <config.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+typedef struct client client_t;
+
+typedef struct request {
+    struct request *next;
+    client_t *client;
+    char id[DAEMON_MAX_ID_LENGTH+1];
+    char *arguments;
+    struct timespec queued;
+} request_t;
+
+struct client {
+    int fd;
+    // Requests waiting for a worker, oldest first.
+    request_t *first, *last;
+    unsigned n_queued, n_running;
+    // Set once no more requests will be read from the client. The client is
+    // closed when its last request has been answered.
+    bool finished;
+    // Responses not yet sent, which are written whenever the socket has
+    // room so that a client which is slow to read doesn't hold up a worker.
+    // 'broken' is set once sending has failed. Protected by write_mutex.
+    pthread_mutex_t write_mutex;
+    char *output;
+    size_t output_length, output_capacity;
+    bool broken;
+    // Incomplete line read from the client.
+    char line[DAEMON_MAX_LINE_LENGTH];
+    size_t line_length;
+};
+
+typedef struct server {
+    const daemon_handler_t *handler;
+    unsigned n_workers;
+    // Protects everything below (apart from the clients' line buffers, which
+    // are only used by the thread running run_daemon()).
+    pthread_mutex_t mutex;
+    pthread_cond_t work;
+    client_t *clients[DAEMON_MAX_CLIENTS];
+    unsigned n_clients;
+    // Index of the client to take the next request from.
+    unsigned next_client;
+    bool stopping;
+    uint64_t n_queued, max_queued, n_running, n_completed, n_failed;
+    // Total time in seconds that completed requests spent queued and running.
+    double total_wait, total_service;
+    struct timespec started;
+} server_t;
+
+// Written to by signal handlers and workers to wake the thread running
+// run_daemon().
+static int wake_pipe[2] = { -1, -1 };
+static volatile sig_atomic_t stop_requested;
+
+static void wake(void)
+{
+    char c = 0;
+    // If the pipe is full, a wakeup is already pending.
+    if (write(wake_pipe[1], &c, 1) < 0) { }
+}
+
+static void handle_stop_signal(int sig)
+{
+    (void)sig;
+    stop_requested = 1;
+    int saved_errno = errno;
+    wake();
+    errno = saved_errno;
+}
+
+static double seconds_since(const struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + ((now.tv_nsec - start->tv_nsec) / 1e9);
+}
+
+// Must be called with server->mutex held.
+static void drop_requests(server_t *server, client_t *client)
+{
+    while (client->first) {
+        request_t *r = client->first;
+        client->first = r->next;
+        free(r->arguments);
+        free(r);
+    }
+    client->last = NULL;
+    server->n_queued -= client->n_queued;
+    client->n_queued = 0;
+}
+
+static bool append_output(client_t *client, const char *data, size_t length)
+{
+    if (client->output_length + length > client->output_capacity) {
+        size_t capacity = client->output_capacity ? client->output_capacity : 4096;
+        while (capacity < client->output_length + length)
+            capacity *= 2;
+        char *output = realloc(client->output, capacity);
+        if (! output)
+            return false;
+        client->output = output;
+        client->output_capacity = capacity;
+    }
+    memcpy(client->output + client->output_length, data, length);
+    client->output_length += length;
+    return true;
+}
+
+// Sends as much pending output as the socket will take without blocking.
+// Must be called with client->write_mutex held. Returns false if sending
+// has failed.
+static bool flush_output(client_t *client)
+{
+    size_t sent = 0;
+    while (! client->broken && sent < client->output_length) {
+        ssize_t n = send(client->fd, client->output + sent, client->output_length - sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            client->broken = true;
+        }
+        else {
+            sent += n;
+        }
+    }
+    if (client->broken) {
+        client->output_length = 0;
+        return false;
+    }
+    client->output_length -= sent;
+    memmove(client->output, client->output + sent, client->output_length);
+    return true;
+}
+
+// Called when sending to a client has failed.
+static void abandon_client(server_t *server, client_t *client)
+{
+    // Nobody is listening for the answers to the other requests.
+    pthread_mutex_lock(&server->mutex);
+    drop_requests(server, client);
+    client->finished = true;
+    pthread_mutex_unlock(&server->mutex);
+    wake();
+}
+
+static void respond(server_t *server, client_t *client, const char *id, int status, const char *body, size_t length)
+{
+    char header[DAEMON_MAX_ID_LENGTH + 64];
+    int header_length = snprintf(header, sizeof(header), "%s %d %zu\n", id, status, length);
+
+    pthread_mutex_lock(&client->write_mutex);
+    bool failed = false, pending = false;
+    if (! client->broken) {
+        if (! append_output(client, header, header_length) || ! append_output(client, body, length))
+            client->broken = true;
+        failed = ! flush_output(client);
+        pending = client->output_length > 0;
+    }
+    pthread_mutex_unlock(&client->write_mutex);
+
+    if (failed)
+        abandon_client(server, client);
+    else if (pending)
+        wake(); // So that the rest is sent when there's room.
+}
+
+static void respond_with_stats(server_t *server, client_t *client, const char *id)
+{
+    char body[1024];
+    pthread_mutex_lock(&server->mutex);
+    double uptime = seconds_since(&server->started);
+    uint64_t n_done = server->n_completed + server->n_failed;
+    int length = snprintf(body, sizeof(body),
+                          "clients,%u\n"
+                          "workers,%u\n"
+                          "queued,%llu\n"
+                          "max_queued,%llu\n"
+                          "running,%llu\n"
+                          "completed,%llu\n"
+                          "failed,%llu\n"
+                          "uptime_seconds,%f\n"
+                          "requests_per_second,%f\n"
+                          "mean_wait_ms,%f\n"
+                          "mean_service_ms,%f\n",
+                          server->n_clients, server->n_workers,
+                          (unsigned long long)server->n_queued, (unsigned long long)server->max_queued,
+                          (unsigned long long)server->n_running, (unsigned long long)server->n_completed,
+                          (unsigned long long)server->n_failed, uptime,
+                          uptime > 0 ? n_done / uptime : 0.0,
+                          n_done ? server->total_wait * 1000 / n_done : 0.0,
+                          n_done ? server->total_service * 1000 / n_done : 0.0);
+    pthread_mutex_unlock(&server->mutex);
+    respond(server, client, id, 0, body, length);
+}
+
+// Takes the oldest request of the next client (after the one served last)
+// which has any. Must be called with server->mutex held and server->n_queued > 0.
+static request_t *take_request(server_t *server)
+{
+    for (unsigned k = 0; k < server->n_clients; ++k) {
+        unsigned i = (server->next_client + k) % server->n_clients;
+        client_t *client = server->clients[i];
+        request_t *r = client->first;
+        if (! r)
+            continue;
+        client->first = r->next;
+        if (! client->first)
+            client->last = NULL;
+        --(client->n_queued);
+        ++(client->n_running);
+        --(server->n_queued);
+        ++(server->n_running);
+        server->next_client = (i + 1) % server->n_clients;
+        return r;
+    }
+    return NULL;
+}
+
+static void *worker(void *arg)
+{
+    server_t *server = arg;
+    void *worker_data = server->handler->start_worker();
+
+    for (;;) {
+        pthread_mutex_lock(&server->mutex);
+        while (! server->stopping && server->n_queued == 0)
+            pthread_cond_wait(&server->work, &server->mutex);
+        request_t *r = server->stopping ? NULL : take_request(server);
+        pthread_mutex_unlock(&server->mutex);
+        if (! r)
+            break;
+
+        struct timespec started;
+        clock_gettime(CLOCK_MONOTONIC, &started);
+        double wait = seconds_since(&r->queued);
+
+        char *body = NULL;
+        size_t length = 0;
+        char error[256];
+        int status;
+        FILE *out = open_memstream(&body, &length);
+        if (out) {
+            status = server->handler->run(worker_data, r->arguments, out, error, sizeof(error));
+            fclose(out);
+        }
+        else {
+            status = 1;
+            snprintf(error, sizeof(error), "Out of memory");
+        }
+        if (status == 0)
+            respond(server, r->client, r->id, 0, body, length);
+        else
+            respond(server, r->client, r->id, status, error, strlen(error));
+        free(body);
+
+        pthread_mutex_lock(&server->mutex);
+        client_t *client = r->client;
+        --(client->n_running);
+        --(server->n_running);
+        if (status == 0)
+            ++(server->n_completed);
+        else
+            ++(server->n_failed);
+        server->total_wait += wait;
+        server->total_service += seconds_since(&started);
+        bool done_with_client = client->finished && client->n_queued == 0 && client->n_running == 0;
+        pthread_mutex_unlock(&server->mutex);
+        if (done_with_client)
+            wake();
+
+        free(r->arguments);
+        free(r);
+    }
+
+    server->handler->end_worker(worker_data);
+    return NULL;
+}
+
+// Handles a complete line from a client. Returns false if the client should
+// be disconnected.
+static bool handle_line(server_t *server, client_t *client, char *line)
+{
+    size_t id_length = strcspn(line, " \t\r");
+    char *arguments = line + id_length;
+    arguments += strspn(arguments, " \t\r");
+    if (id_length == 0)
+        return true; // Blank line.
+
+    char id[DAEMON_MAX_ID_LENGTH+1];
+    if (id_length > DAEMON_MAX_ID_LENGTH) {
+        char message[64];
+        snprintf(message, sizeof(message), "Request ID too long (max is %u characters)", DAEMON_MAX_ID_LENGTH);
+        respond(server, client, "-", 1, message, strlen(message));
+        return false;
+    }
+    memcpy(id, line, id_length);
+    id[id_length] = '\0';
+
+    size_t arguments_length = strlen(arguments);
+    while (arguments_length > 0 && (arguments[arguments_length-1] == '\r' || arguments[arguments_length-1] == ' '))
+        arguments[--arguments_length] = '\0';
+    if (! strcmp(arguments, "stats")) {
+        respond_with_stats(server, client, id);
+        return true;
+    }
+
+    request_t *r = malloc(sizeof(request_t));
+    char *copy = strdup(arguments);
+    if (! r || ! copy) {
+        free(r);
+        free(copy);
+        const char *message = "Out of memory";
+        respond(server, client, id, 1, message, strlen(message));
+        return true;
+    }
+    r->next = NULL;
+    r->client = client;
+    strcpy(r->id, id);
+    r->arguments = copy;
+    clock_gettime(CLOCK_MONOTONIC, &r->queued);
+
+    pthread_mutex_lock(&server->mutex);
+    if (client->finished) {
+        // Sending a response has failed.
+        pthread_mutex_unlock(&server->mutex);
+        free(r->arguments);
+        free(r);
+        return false;
+    }
+    if (client->last)
+        client->last->next = r;
+    else
+        client->first = r;
+    client->last = r;
+    ++(client->n_queued);
+    if (++(server->n_queued) > server->max_queued)
+        server->max_queued = server->n_queued;
+    pthread_cond_signal(&server->work);
+    pthread_mutex_unlock(&server->mutex);
+    return true;
+}
+
+static void finish_client(server_t *server, client_t *client, bool broken)
+{
+    pthread_mutex_lock(&server->mutex);
+    if (broken)
+        drop_requests(server, client);
+    client->finished = true;
+    pthread_mutex_unlock(&server->mutex);
+}
+
+static void read_requests(server_t *server, client_t *client)
+{
+    ssize_t n = read(client->fd, client->line + client->line_length, DAEMON_MAX_LINE_LENGTH - client->line_length);
+    if (n < 0 && (errno == EINTR || errno == EAGAIN))
+        return;
+    if (n <= 0) {
+        finish_client(server, client, n < 0);
+        return;
+    }
+    client->line_length += n;
+
+    char *start = client->line, *end;
+    while ((end = memchr(start, '\n', client->line + client->line_length - start))) {
+        *end = '\0';
+        if (! handle_line(server, client, start)) {
+            finish_client(server, client, false);
+            return;
+        }
+        start = end + 1;
+    }
+    client->line_length -= start - client->line;
+    memmove(client->line, start, client->line_length);
+
+    if (client->line_length == DAEMON_MAX_LINE_LENGTH) {
+        char message[64];
+        snprintf(message, sizeof(message), "Request too long (max is %u characters)", DAEMON_MAX_LINE_LENGTH - 1);
+        respond(server, client, "-", 1, message, strlen(message));
+        finish_client(server, client, false);
+    }
+}
+
+static void accept_client(server_t *server, int listen_fd)
+{
+    int fd = accept(listen_fd, NULL, NULL);
+    if (fd < 0)
+        return;
+    if (server->n_clients == DAEMON_MAX_CLIENTS) {
+        close(fd);
+        return;
+    }
+    client_t *client = calloc(1, sizeof(client_t));
+    if (! client) {
+        close(fd);
+        return;
+    }
+    client->fd = fd;
+    pthread_mutex_init(&client->write_mutex, NULL);
+
+    pthread_mutex_lock(&server->mutex);
+    server->clients[server->n_clients++] = client;
+    pthread_mutex_unlock(&server->mutex);
+}
+
+static bool has_output(client_t *client)
+{
+    pthread_mutex_lock(&client->write_mutex);
+    bool pending = client->output_length > 0;
+    pthread_mutex_unlock(&client->write_mutex);
+    return pending;
+}
+
+static void free_client(client_t *client)
+{
+    close(client->fd);
+    pthread_mutex_destroy(&client->write_mutex);
+    free(client->output);
+    free(client);
+}
+
+// Closes clients which have been finished with.
+static void remove_finished_clients(server_t *server)
+{
+    pthread_mutex_lock(&server->mutex);
+    for (unsigned i = 0; i < server->n_clients;) {
+        client_t *client = server->clients[i];
+        if (! (client->finished && client->n_queued == 0 && client->n_running == 0 && ! has_output(client))) {
+            ++i;
+            continue;
+        }
+        free_client(client);
+        server->clients[i] = server->clients[--(server->n_clients)];
+        if (server->next_client >= server->n_clients)
+            server->next_client = 0;
+    }
+    pthread_mutex_unlock(&server->mutex);
+}
+
+// Sends the responses which are left once the workers have stopped, giving up
+// on clients which don't read them within DAEMON_SHUTDOWN_TIMEOUT_MS.
+static void drain_output(server_t *server, struct pollfd *fds)
+{
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    client_t *polled[DAEMON_MAX_CLIENTS];
+    for (;;) {
+        unsigned n_fds = 0;
+        for (unsigned i = 0; i < server->n_clients; ++i) {
+            if (! has_output(server->clients[i]))
+                continue;
+            polled[n_fds] = server->clients[i];
+            fds[n_fds].fd = server->clients[i]->fd;
+            fds[n_fds].events = POLLOUT;
+            ++n_fds;
+        }
+        int remaining_ms = DAEMON_SHUTDOWN_TIMEOUT_MS - (int)(seconds_since(&start) * 1000);
+        if (n_fds == 0 || remaining_ms <= 0)
+            return;
+
+        if (poll(fds, n_fds, remaining_ms) < 0) {
+            if (errno == EINTR)
+                continue;
+            return;
+        }
+        for (unsigned i = 0; i < n_fds; ++i) {
+            if (! fds[i].revents)
+                continue;
+            // A client which can't be sent to has its output discarded.
+            pthread_mutex_lock(&polled[i]->write_mutex);
+            flush_output(polled[i]);
+            pthread_mutex_unlock(&polled[i]->write_mutex);
+        }
+    }
+}
+
+static int open_socket(const char *socket_path, char *error, size_t error_size)
+{
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(address.sun_path)) {
+        snprintf(error, error_size, "Socket path '%s' is too long", socket_path);
+        return -1;
+    }
+    strcpy(address.sun_path, socket_path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        snprintf(error, error_size, "Error creating socket: %s", strerror(errno));
+        return -1;
+    }
+    // Remove the socket left behind by a previous daemon, if any.
+    unlink(socket_path);
+    if (bind(fd, (struct sockaddr *)&address, sizeof(address)) != 0 || listen(fd, SOMAXCONN) != 0) {
+        snprintf(error, error_size, "Error listening on '%s': %s", socket_path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+bool run_daemon(const char *socket_path, unsigned n_workers, const daemon_handler_t *handler, char *error, size_t error_size)
+{
+    server_t *server = calloc(1, sizeof(server_t));
+    pthread_t *threads = calloc(n_workers, sizeof(pthread_t));
+    struct pollfd *fds = calloc(DAEMON_MAX_CLIENTS + 2, sizeof(struct pollfd));
+    if (! server || ! threads || ! fds) {
+        snprintf(error, error_size, "Out of memory");
+        free(server);
+        free(threads);
+        free(fds);
+        return false;
+    }
+
+    int listen_fd = open_socket(socket_path, error, error_size);
+    if (listen_fd < 0 || pipe(wake_pipe) != 0) {
+        if (listen_fd >= 0) {
+            snprintf(error, error_size, "Error creating pipe: %s", strerror(errno));
+            close(listen_fd);
+            unlink(socket_path);
+        }
+        free(server);
+        free(threads);
+        free(fds);
+        return false;
+    }
+    fcntl(wake_pipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(wake_pipe[1], F_SETFL, O_NONBLOCK);
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handle_stop_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    server->handler = handler;
+    server->n_workers = n_workers;
+    pthread_mutex_init(&server->mutex, NULL);
+    pthread_cond_init(&server->work, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &server->started);
+
+    unsigned n_started = 0;
+    for (; n_started < n_workers; ++n_started) {
+        if (pthread_create(&threads[n_started], NULL, worker, server) != 0)
+            break;
+    }
+
+    client_t *polled[DAEMON_MAX_CLIENTS];
+    while (! stop_requested && n_started > 0) {
+        remove_finished_clients(server);
+
+        fds[0].fd = wake_pipe[0];
+        fds[0].events = POLLIN;
+        fds[1].fd = listen_fd;
+        fds[1].events = server->n_clients < DAEMON_MAX_CLIENTS ? POLLIN : 0;
+        unsigned n_fds = 2, n_polled = 0;
+        pthread_mutex_lock(&server->mutex);
+        for (unsigned i = 0; i < server->n_clients; ++i) {
+            client_t *client = server->clients[i];
+            short events = (client->finished ? 0 : POLLIN) | (has_output(client) ? POLLOUT : 0);
+            if (! events)
+                continue;
+            polled[n_polled++] = client;
+            fds[n_fds].fd = client->fd;
+            fds[n_fds].events = events;
+            ++n_fds;
+        }
+        pthread_mutex_unlock(&server->mutex);
+
+        if (poll(fds, n_fds, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+
+        if (fds[0].revents) {
+            char buf[64];
+            while (read(wake_pipe[0], buf, sizeof(buf)) > 0) { }
+        }
+        for (unsigned i = 0; i < n_polled; ++i) {
+            short revents = fds[i+2].revents;
+            if (revents & (POLLOUT | POLLERR | POLLHUP)) {
+                pthread_mutex_lock(&polled[i]->write_mutex);
+                bool failed = ! flush_output(polled[i]);
+                pthread_mutex_unlock(&polled[i]->write_mutex);
+                if (failed)
+                    abandon_client(server, polled[i]);
+            }
+            if ((fds[i+2].events & POLLIN) && revents)
+                read_requests(server, polled[i]);
+        }
+        if (fds[1].revents & POLLIN)
+            accept_client(server, listen_fd);
+    }
+
+    // Let running requests finish, and drop queued ones.
+    pthread_mutex_lock(&server->mutex);
+    server->stopping = true;
+    for (unsigned i = 0; i < server->n_clients; ++i)
+        drop_requests(server, server->clients[i]);
+    pthread_cond_broadcast(&server->work);
+    pthread_mutex_unlock(&server->mutex);
+    for (unsigned i = 0; i < n_started; ++i)
+        pthread_join(threads[i], NULL);
+
+    drain_output(server, fds);
+    for (unsigned i = 0; i < server->n_clients; ++i)
+        free_client(server->clients[i]);
+    close(listen_fd);
+    unlink(socket_path);
+    close(wake_pipe[0]);
+    close(wake_pipe[1]);
+    pthread_mutex_destroy(&server->mutex);
+    pthread_cond_destroy(&server->work);
+    free(server);
+    free(threads);
+    free(fds);
+
+    if (n_started == 0) {
+        snprintf(error, error_size, "Error starting worker threads");
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,62 @@
+//
+// A server for numbersim requests on a Unix domain socket, started with
+// 'numbersim --daemon SOCKET [THREADS]'.
+//
+// Any number of clients may connect. Each sends requests as lines of the form
+//
+//     ID ARGUMENTS
+//
+// where ID is any tag without whitespace (of up to DAEMON_MAX_ID_LENGTH
+// characters) chosen by the client, and ARGUMENTS is a line of the kind
+// numbersim reads from stdin. Requests are queued separately for each client
+// and run by a pool of worker threads, which take requests from the clients
+// in turn, so a client with a long queue can't hold up the others. Responses
+// are sent as soon as they are ready, which may not be in the order the
+// requests were sent. Each is a line
+//
+//     ID STATUS LENGTH
+//
+// followed by LENGTH bytes. STATUS is 0 if the request succeeded, in which
+// case the bytes are its output (exactly as numbersim would write it to
+// stdout). Otherwise STATUS is the code numbersim would have exited with and
+// the bytes are the error message.
+//
+// A line longer than DAEMON_MAX_LINE_LENGTH - 1 characters, or with too long
+// an ID, gets a response with ID '-' and STATUS 1, and the connection is then
+// closed.
+//
+// The request 'ID stats' is answered straight away with lines 'NAME,VALUE'
+// giving the number of clients, workers, queued requests (now and at most),
+// running requests, completed and failed requests, uptime, throughput and
+// the mean time requests spent queued and running.
+//
+// After a client shuts down its side of the connection, its remaining
+// requests are still run and answered. The daemon stops on SIGINT or
+// SIGTERM, finishing the requests which are running and sending every
+// response which is ready (to clients which read it within
+// DAEMON_SHUTDOWN_TIMEOUT_MS).
+//
+
+#ifndef DAEMON_H
+#define DAEMON_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#define DAEMON_MAX_ID_LENGTH 64
+
+typedef struct daemon_handler {
+    // Called by each worker thread when it starts and stops. The value
+    // returned by start_worker is passed to run.
+    void *(*start_worker)(void);
+    void (*end_worker)(void *worker_data);
+    // Runs the arguments of a request (which it may modify), writing the
+    // output to 'out'. Returns 0, or an exit code with a message in 'error'.
+    int (*run)(void *worker_data, char *arguments, FILE *out, char *error, size_t error_size);
+} daemon_handler_t;
+
+// Returns false, with a message in 'error', if the socket can't be set up.
+bool run_daemon(const char *socket_path, unsigned n_workers, const daemon_handler_t *handler, char *error, size_t error_size);
+
+#endif
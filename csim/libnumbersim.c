@@ -0,0 +1,283 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libnumbersim.h>
+#include <sim.h>
+#include <parser.h>
+
+#define ERROR_MESSAGE_MAX_LENGTH 256
+
+struct ns_context {
+    // Initially all zeroes, so that the name of the first language is the
+    // empty string.
+    language_t languages[MAX_LANGUAGES];
+    char error[ERROR_MESSAGE_MAX_LENGTH];
+};
+
+ns_context_t *ns_context_new(void)
+{
+    return calloc(1, sizeof(ns_context_t));
+}
+
+void ns_context_free(ns_context_t *ctx)
+{
+    free(ctx);
+}
+
+const char *ns_context_error(const ns_context_t *ctx)
+{
+    return ctx->error;
+}
+
+const char *ns_error_string(ns_error_t error)
+{
+    switch (error) {
+    case NS_OK:                      return "No error";
+    case NS_ERROR_OUT_OF_MEMORY:     return "Out of memory";
+    case NS_ERROR_LANGUAGE_FILE:     return "Error loading language file";
+    case NS_ERROR_UNKNOWN_LANGUAGE:  return "Unknown language";
+    case NS_ERROR_BAD_LEARNING_RATE: return "Bad learning rate";
+    case NS_ERROR_BAD_MAX_CUE:       return "Bad maximum cue cardinality";
+    case NS_ERROR_BAD_DISTRIBUTION:  return "Bad probability distribution";
+    case NS_ERROR_TOO_MANY_TRIALS:   return "Too many trials";
+    case NS_ERROR_INCOMPATIBLE_STATES: return "States cannot be run in lockstep";
+    }
+    return "Unknown error";
+}
+
+static ns_error_t fail(ns_context_t *ctx, ns_error_t error, const char *message)
+{
+    snprintf(ctx->error, sizeof(ctx->error), "%s", message ? message : ns_error_string(error));
+    return error;
+}
+
+ns_error_t ns_load_languages(ns_context_t *ctx, const char *filename)
+{
+    ctx->error[0] = '\0';
+    if (! get_languages(filename, ctx->languages, ctx->error, sizeof(ctx->error)))
+        return NS_ERROR_LANGUAGE_FILE;
+    return NS_OK;
+}
+
+unsigned ns_language_count(const ns_context_t *ctx)
+{
+    unsigned n;
+    for (n = 0; n < MAX_LANGUAGES && ctx->languages[n].name[0] != '\0'; ++n);
+    return n;
+}
+
+const char *ns_language_name(const ns_context_t *ctx, unsigned index)
+{
+    return ctx->languages[index].name;
+}
+
+static ns_error_t init_state(ns_context_t *ctx, const ns_config_t *config, state_t *state)
+{
+
+    if (! (config->learning_rate > 0))
+        return fail(ctx, NS_ERROR_BAD_LEARNING_RATE, "Bad value for learning_rate (must be > 0)");
+    if (config->max_cue == 0)
+        return fail(ctx, NS_ERROR_BAD_MAX_CUE, "max_cue must be greater than 0");
+    if (config->max_cue > MAX_CARDINALITY)
+        return fail(ctx, NS_ERROR_BAD_MAX_CUE, "Value of max_cue is too big.");
+    if (config->partitioned && config->n_trials > RUN_STREAM_STRIDE)
+        return fail(ctx, NS_ERROR_TOO_MANY_TRIALS, "Too many trials for a partitioned stream");
+    if (config->max_cue > 1 && ! config->distribution)
+        return fail(ctx, NS_ERROR_BAD_DISTRIBUTION, "No probability distribution given");
+
+    const language_t *lang;
+    if (! find_language(ctx->languages, config->language_file, config->language, &lang, ctx->error, sizeof(ctx->error)))
+        return NS_ERROR_LANGUAGE_FILE;
+    if (! lang) {
+        snprintf(ctx->error, sizeof(ctx->error), "Could not find language %s", config->language);
+        return NS_ERROR_UNKNOWN_LANGUAGE;
+    }
+    memcpy(&(state->language), lang, sizeof(language_t));
+
+    state->max_trials = config->n_trials;
+    state->seed1 = config->seed1;
+    state->seed2 = config->seed2;
+    state->partitioned = config->partitioned;
+    state->max_cue = config->max_cue;
+    state->learning_rate = config->learning_rate;
+    state->output_mode = config->output_mode;
+    state->quit_after_n_correct = config->quit_after_n_correct;
+    set_distribution(state, config->distribution);
+
+    if (! alloc_correct_at(state))
+        return fail(ctx, NS_ERROR_OUT_OF_MEMORY, NULL);
+
+    return NS_OK;
+}
+
+ns_error_t ns_state_new(ns_context_t *ctx, const ns_config_t *config, ns_state_t **state)
+{
+    ctx->error[0] = '\0';
+    *state = calloc(1, sizeof(state_t));
+    if (! *state)
+        return fail(ctx, NS_ERROR_OUT_OF_MEMORY, NULL);
+
+    ns_error_t error = init_state(ctx, config, *state);
+    if (error != NS_OK) {
+        ns_state_free(*state);
+        *state = NULL;
+    }
+    return error;
+}
+
+void ns_state_free(state_t *state)
+{
+    if (! state)
+        return;
+    free_correct_at(state);
+    free(state);
+}
+
+void ns_set_distribution(state_t *state, const double *distribution)
+{
+    set_distribution(state, distribution);
+}
+
+void ns_start_run(state_t *state, uint64_t run)
+{
+    reset_state(state, run);
+}
+
+void ns_run(state_t *state, ns_trial_callback_t before_trial, void *data)
+{
+    if (! before_trial) {
+        run_trials(state, state->max_trials);
+        compute_compound_cue_assocs(state);
+        return;
+    }
+
+    uint_fast32_t card = 0;
+    int marker_index = -1;
+    while (state->n_trials < state->max_trials) {
+        before_trial(data, state, marker_index, card);
+        if (! run_trial(state, &card, &marker_index))
+            break;
+    }
+    compute_compound_cue_assocs(state);
+}
+
+void ns_compound_cue_assocs(const state_t *state, double *out)
+{
+    double assocs[MAX_CARDINALITY][MAX_MARKERS];
+    get_compound_cue_assocs(state, assocs);
+    for (unsigned i = 0; i < state->max_cue; ++i) {
+        for (unsigned j = 0; j < state->language.num_markers; ++j)
+            out[(i * state->language.num_markers) + j] = assocs[i][j];
+    }
+}
+
+ns_error_t ns_run_lockstep(ns_context_t *ctx, state_t *const *states, size_t n_states)
+{
+    ctx->error[0] = '\0';
+    if (n_states == 0)
+        return NS_OK;
+
+    const state_t *first = states[0];
+    for (size_t i = 1; i < n_states; ++i) {
+        const state_t *s = states[i];
+        if (s->max_cue != first->max_cue ||
+            s->max_trials != first->max_trials ||
+            s->n_trials != first->n_trials ||
+            s->stopped != first->stopped ||
+            s->rand_state.state != first->rand_state.state ||
+            s->rand_state.inc != first->rand_state.inc ||
+            memcmp(s->thresholds, first->thresholds, sizeof(first->thresholds))) {
+            return fail(ctx, NS_ERROR_INCOMPATIBLE_STATES, "States must have the same seeds, run, max_cue, number of trials and distribution to be run in lockstep");
+        }
+    }
+
+    run_trials_lockstep(states, n_states, first->max_trials);
+    for (size_t i = 0; i < n_states; ++i)
+        compute_compound_cue_assocs(states[i]);
+    return NS_OK;
+}
+
+const char *ns_state_language(const state_t *state)
+{
+    return state->language.name;
+}
+
+unsigned ns_marker_count(const state_t *state)
+{
+    return state->language.num_markers;
+}
+
+const char *ns_marker_name(const state_t *state, unsigned index)
+{
+    return state->language.markers[index];
+}
+
+int ns_correct_marker(const state_t *state, unsigned cardinality_index)
+{
+    return state->language.n_to_marker[cardinality_index];
+}
+
+unsigned ns_max_cue(const state_t *state)
+{
+    return state->max_cue;
+}
+
+uint64_t ns_max_trials(const state_t *state)
+{
+    return state->max_trials;
+}
+
+uint64_t ns_trials_run(const state_t *state)
+{
+    return state->n_trials;
+}
+
+uint64_t ns_correct_for(const state_t *state, unsigned cardinality_index)
+{
+    if (cardinality_index < state->max_cue)
+        return state->marker_has_been_correct_for_last[cardinality_index];
+    return state->all_markers_have_been_correct_for_last;
+}
+
+void ns_rand_state(const state_t *state, uint64_t *rand_state, uint64_t *inc)
+{
+    *rand_state = state->rand_state.state;
+    *inc = state->rand_state.inc;
+}
+
+void ns_trials_to_criterion(const state_t *state, uint64_t *out)
+{
+    for (unsigned i = 0; i < state->max_cue; ++i) {
+        uint_fast64_t correct_for = state->marker_has_been_correct_for_last[i];
+        if (correct_for < state->quit_after_n_correct)
+            // This marker was never correct for the required number of trials.
+            out[i] = state->n_trials;
+        else
+            out[i] = state->n_trials - correct_for;
+    }
+
+    // For all cardinalities.
+    if (state->all_markers_have_been_correct_for_last < state->quit_after_n_correct)
+        out[state->max_cue] = state->n_trials;
+    else
+        out[state->max_cue] = state->n_trials - state->all_markers_have_been_correct_for_last;
+}
+
+bool ns_was_correct_at(const state_t *state, unsigned cardinality_index, uint64_t trial)
+{
+    return was_correct_at(state, cardinality_index, trial);
+}
+
+void ns_add_correct_counts(const state_t *state, uint64_t *counts)
+{
+    for (uint_fast64_t j = 0; j < state->n_trials; ++j) {
+        uint_fast8_t all = 1;
+        for (unsigned i = 0; i < state->max_cue; ++i) {
+            uint_fast8_t v = was_correct_at(state, i, j);
+            counts[(i * state->max_trials) + j] += v;
+            all &= v;
+        }
+        counts[(state->max_cue * state->max_trials) + j] += all;
+    }
+}
@@ -0,0 +1,191 @@
+//
+// libnumbersim: the simulation as a library (build with 'make libnumbersim.a'
+// or 'make libnumbersim.so'). numbersim itself is a command line wrapper
+// around this API.
+//
+// Typical use:
+//
+//     ns_context_t *ctx = ns_context_new();
+//     ns_config_t config = { ... };
+//     ns_state_t *state;
+//     if (ns_state_new(ctx, &config, &state) != NS_OK)
+//         fprintf(stderr, "%s\n", ns_context_error(ctx));
+//     for (uint64_t run = 0; run < n_runs; ++run) {
+//         ns_start_run(state, run);
+//         ns_run(state, NULL, NULL);
+//         ns_trials_to_criterion(state, results + (run * (config.max_cue + 1)));
+//     }
+//     ns_state_free(state);
+//     ns_context_free(ctx);
+//
+// Nothing in the library prints or exits. There is no global state: a context
+// holds the table of languages loaded from a language file, and each state
+// holds everything needed for a run. Calls which take a context must not be
+// made concurrently on the same context, but any number of states can be run
+// concurrently on different threads. Only the ns_ functions declared here are
+// exported.
+//
+
+#ifndef LIBNUMBERSIM_H
+#define LIBNUMBERSIM_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#if __cplusplus
+extern "C" {
+#endif
+
+#if defined(__GNUC__)
+#define NS_API __attribute__((visibility("default")))
+#else
+#define NS_API
+#endif
+
+typedef enum ns_error {
+    NS_OK = 0,
+    NS_ERROR_OUT_OF_MEMORY,
+    NS_ERROR_LANGUAGE_FILE,
+    NS_ERROR_UNKNOWN_LANGUAGE,
+    NS_ERROR_BAD_LEARNING_RATE,
+    NS_ERROR_BAD_MAX_CUE,
+    NS_ERROR_BAD_DISTRIBUTION,
+    NS_ERROR_TOO_MANY_TRIALS,
+    NS_ERROR_INCOMPATIBLE_STATES
+} ns_error_t;
+
+typedef enum ns_output_mode {
+    NS_OUTPUT_MODE_FULL,
+    NS_OUTPUT_MODE_SUMMARY,
+    NS_OUTPUT_MODE_RANGE_SUMMARY,
+    NS_OUTPUT_MODE_AGGREGATE,
+    NS_OUTPUT_MODE_TRAJECTORY
+} ns_output_mode_t;
+
+typedef struct ns_context ns_context_t;
+typedef struct ns_state ns_state_t;
+
+// Returns NULL if out of memory.
+NS_API ns_context_t *ns_context_new(void);
+NS_API void ns_context_free(ns_context_t *ctx);
+
+// A description of the most recent error returned by a call taking 'ctx'.
+NS_API const char *ns_context_error(const ns_context_t *ctx);
+// A short description of an error code.
+NS_API const char *ns_error_string(ns_error_t error);
+
+// Loads the languages in 'filename' into 'ctx' (replacing any already
+// loaded), after which they can be listed using the following two functions.
+NS_API ns_error_t ns_load_languages(ns_context_t *ctx, const char *filename);
+NS_API unsigned ns_language_count(const ns_context_t *ctx);
+NS_API const char *ns_language_name(const ns_context_t *ctx, unsigned index);
+
+typedef struct ns_config {
+    const char *language_file;
+    const char *language;
+    uint64_t seed1, seed2;
+    // If true, run i starts i * RUN_STREAM_STRIDE random numbers into the
+    // stream given by the seeds, where i is at most MAX_PARTITIONED_RUN (see
+    // config.h). Otherwise every run starts at the beginning of the stream.
+    bool partitioned;
+    double learning_rate;
+    unsigned max_cue;
+    // Number of trials in each run.
+    uint64_t n_trials;
+    // Runs only stop early in OUTPUT_MODE_SUMMARY, after all markers have
+    // been correct for quit_after_n_correct trials (if it is not 0).
+    ns_output_mode_t output_mode;
+    unsigned quit_after_n_correct;
+    // max_cue-1 p values. The leftover probability mass is for cues of
+    // cardinality max_cue.
+    const double *distribution;
+} ns_config_t;
+
+// Creates a state from 'config', loading the language file into 'ctx' if the
+// language has not already been loaded. The state keeps no reference to the
+// context or the config. On error, *state is set to NULL.
+NS_API ns_error_t ns_state_new(ns_context_t *ctx, const ns_config_t *config, ns_state_t **state);
+// Does nothing if 'state' is NULL.
+NS_API void ns_state_free(ns_state_t *state);
+
+// Replaces the distribution given in the config (with max_cue-1 p values, as
+// there), e.g. to use a different one for each run.
+NS_API void ns_set_distribution(ns_state_t *state, const double *distribution);
+
+// Resets the state for the start of the given run.
+NS_API void ns_start_run(ns_state_t *state, uint64_t run);
+
+// Called before each trial with the cue of the previous trial (a
+// marker_index of -1 before the first trial). A callback which needs the
+// associations should get them with ns_compound_cue_assocs() on just the
+// trials where it uses them, since this takes time proportional to max_cue
+// times the number of markers.
+typedef void (*ns_trial_callback_t)(void *data, const ns_state_t *state, int marker_index, uint_fast32_t cardinality);
+
+// Runs trials until the end of the run. 'before_trial' may be NULL.
+NS_API void ns_run(ns_state_t *state, ns_trial_callback_t before_trial, void *data);
+
+// Writes the current compound cue association of marker j with cardinality
+// index i to out[(i * ns_marker_count(state)) + j], for i < max_cue.
+NS_API void ns_compound_cue_assocs(const ns_state_t *state, double *out);
+
+// Runs the current run of several states in lockstep. The states must have
+// been initialized from configs which differ only in their language, learning
+// rate, output mode and quit_after_n_correct, and started on the same run.
+// The cue cardinality for each trial is drawn once and shared by all the
+// states, so the results are the same as running each state with ns_run(),
+// but the random number generation is done only once. Returns
+// NS_ERROR_INCOMPATIBLE_STATES (without running anything) if the states do
+// not match.
+NS_API ns_error_t ns_run_lockstep(ns_context_t *ctx, ns_state_t *const *states, size_t n_states);
+
+//
+// The configuration of a state.
+//
+
+NS_API const char *ns_state_language(const ns_state_t *state);
+NS_API unsigned ns_marker_count(const ns_state_t *state);
+NS_API const char *ns_marker_name(const ns_state_t *state, unsigned index);
+// The index of the marker which is correct for the given cardinality index,
+// or -1 if there is none.
+NS_API int ns_correct_marker(const ns_state_t *state, unsigned cardinality_index);
+NS_API unsigned ns_max_cue(const ns_state_t *state);
+// The number of trials in a run, from the config.
+NS_API uint64_t ns_max_trials(const ns_state_t *state);
+
+//
+// Results of the current run.
+//
+
+// The number of trials run so far.
+NS_API uint64_t ns_trials_run(const ns_state_t *state);
+
+// How many trials in a row, up to the latest, the given cardinality index
+// (or all cardinalities, for an index of max_cue) has been correct for.
+NS_API uint64_t ns_correct_for(const ns_state_t *state, unsigned cardinality_index);
+
+// The random number generator's state and increment, from which a run can
+// be continued.
+NS_API void ns_rand_state(const ns_state_t *state, uint64_t *rand_state, uint64_t *inc);
+
+// Writes max_cue+1 values to 'out': for each cardinality, and then for all
+// cardinalities together, the trial after which the marker was correct for
+// quit_after_n_correct trials or more (or the number of trials if it never
+// was).
+NS_API void ns_trials_to_criterion(const ns_state_t *state, uint64_t *out);
+
+// Whether the given cardinality index (or all cardinalities, for an index of
+// max_cue) was correct at the given trial.
+NS_API bool ns_was_correct_at(const ns_state_t *state, unsigned cardinality_index, uint64_t trial);
+
+// Adds 1 to counts[(i * n_trials) + t] for each cardinality index i (up to
+// and including max_cue, for all cardinalities) which was correct at trial t.
+// 'counts' must have room for (max_cue + 1) * n_trials values.
+NS_API void ns_add_correct_counts(const ns_state_t *state, uint64_t *counts);
+
+#if __cplusplus
+}
+#endif
+
+#endif
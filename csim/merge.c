@@ -0,0 +1,312 @@
+//
+// Example invocations:
+//
+//     numbersim-merge shard0.txt shard1.txt shard2.txt
+//     numbersim-merge -f shard0.txt shard1.txt
+//
+// Combines the output of numbersim runs that were split into shards (see the
+// ':I-J' run range syntax for numbersim's first seed argument). The input
+// files may contain either
+//
+//     *  blocks of 'aggregate' output (a 'runs,N' line followed by one line
+//        per trial), or
+//     *  'range_summary' lines (one per run),
+//
+// but not both. The output is in the format of numbersim's 'aggregate' mode,
+// so merged outputs can themselves be merged again. Output for several
+// combinations of language and learning rate (where each combination follows
+// a line 'language NAME learning_rate RATE') is merged separately for each
+// combination, in the order in which they first appear, but can't be mixed
+// with output for a single combination, which has no such lines. Since
+// the counts are just summed, the result does not depend on how the runs were
+// divided between shards or on the order of the input files, as long as every
+// shard was output in the same mode.
+//
+// Ranges in 'range_summary' lines are counted inclusively at both ends, in
+// the same way as the multisim program in sim.js. This doesn't give the same
+// counts as 'aggregate' output. A range which doesn't start at trial 0 also
+// covers the (incorrect) trial before the trials which were right, a range
+// starting at trial 0 may or may not, and if only trial 0 was right before an
+// incorrect trial, it isn't output at all. Since the exact trials can't be
+// recovered from the ranges, the two formats can't be mixed.
+//
+// Options:
+//
+//     -f    Output the fraction of runs rather than the number of runs.
+//
+// If no files are given, input is read from stdin.
+//
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <ctype.h>
+
+typedef enum input_format {
+    INPUT_FORMAT_UNKNOWN,
+    INPUT_FORMAT_AGGREGATE,
+    INPUT_FORMAT_RANGE_SUMMARY
+} input_format_t;
+
+typedef struct combination {
+    // The line introducing the combination, or NULL for the output of
+    // numbersim runs with a single combination.
+    char *heading;
+    uint_fast64_t n_runs;
+    // Number of columns (max_cue + 1) per trial, or 0 before the first input.
+    unsigned n_columns;
+    uint_fast64_t n_trials;
+    uint_fast64_t trials_capacity;
+    uint_fast64_t *counts;
+} combination_t;
+
+typedef struct merged {
+    // Format of the input read so far.
+    input_format_t format;
+    unsigned n_combinations;
+    combination_t *combinations;
+} merged_t;
+
+static void check_columns(combination_t *combination, unsigned n_columns, const char *filename)
+{
+    if (combination->n_columns == 0) {
+        combination->n_columns = n_columns;
+    }
+    else if (combination->n_columns != n_columns) {
+        fprintf(stderr, "Inconsistent number of cardinalities in %s (%u, expected %u)\n", filename, n_columns - 1, combination->n_columns - 1);
+        exit(2);
+    }
+}
+
+static void check_format(merged_t *merged, input_format_t format, const char *filename, unsigned line_number)
+{
+    if (merged->format == INPUT_FORMAT_UNKNOWN) {
+        merged->format = format;
+    }
+    else if (merged->format != format) {
+        fprintf(stderr, "Can't merge 'aggregate' and 'range_summary' output, which count trials differently (%s, line %u)\n", filename, line_number);
+        exit(6);
+    }
+}
+
+// Returns the index of the combination with the given heading, adding it if
+// it hasn't been seen before.
+static unsigned find_combination(merged_t *merged, const char *heading, const char *filename, unsigned line_number)
+{
+    for (unsigned i = 0; i < merged->n_combinations; ++i) {
+        const char *h = merged->combinations[i].heading;
+        if ((! h && ! heading) || (h && heading && ! strcmp(h, heading)))
+            return i;
+    }
+    if (merged->n_combinations > 0 && (! merged->combinations[0].heading) != (! heading)) {
+        fprintf(stderr, "Can't merge output for one combination of language and learning rate with output for several (%s, line %u)\n", filename, line_number);
+        exit(7);
+    }
+
+    merged->combinations = realloc(merged->combinations, (merged->n_combinations + 1) * sizeof(combination_t));
+    if (! merged->combinations) {
+        fprintf(stderr, "Out of memory\n");
+        exit(3);
+    }
+    combination_t *combination = merged->combinations + merged->n_combinations;
+    memset(combination, 0, sizeof(combination_t));
+    if (heading) {
+        combination->heading = strdup(heading);
+        if (! combination->heading) {
+            fprintf(stderr, "Out of memory\n");
+            exit(3);
+        }
+    }
+    return merged->n_combinations++;
+}
+
+static uint_fast64_t *row_for_trial(combination_t *combination, uint_fast64_t trial)
+{
+    if (trial >= combination->trials_capacity) {
+        uint_fast64_t new_capacity = combination->trials_capacity ? combination->trials_capacity : 1024;
+        while (new_capacity <= trial)
+            new_capacity *= 2;
+        combination->counts = realloc(combination->counts, new_capacity * combination->n_columns * sizeof(uint_fast64_t));
+        if (! combination->counts) {
+            fprintf(stderr, "Out of memory\n");
+            exit(3);
+        }
+        memset(combination->counts + (combination->trials_capacity * combination->n_columns), 0,
+               (new_capacity - combination->trials_capacity) * combination->n_columns * sizeof(uint_fast64_t));
+        combination->trials_capacity = new_capacity;
+    }
+    if (trial >= combination->n_trials)
+        combination->n_trials = trial + 1;
+    return combination->counts + (trial * combination->n_columns);
+}
+
+// Adds a line of the form 'trial,count,...,count' from an aggregate block.
+static void merge_aggregate_line(combination_t *combination, char *line, const char *filename, unsigned line_number)
+{
+    unsigned n_columns = 0;
+    for (const char *p = line; *p; ++p) {
+        if (*p == ',')
+            ++n_columns;
+    }
+    if (n_columns == 0) {
+        fprintf(stderr, "Error parsing %s, line %u\n", filename, line_number);
+        exit(4);
+    }
+    check_columns(combination, n_columns, filename);
+
+    char *p = line;
+    uint_fast64_t trial = strtoull(p, &p, 10);
+    uint_fast64_t *row = row_for_trial(combination, trial);
+    for (unsigned i = 0; i < n_columns; ++i) {
+        if (*p != ',') {
+            fprintf(stderr, "Error parsing %s, line %u\n", filename, line_number);
+            exit(4);
+        }
+        row[i] += strtoull(p + 1, &p, 10);
+    }
+}
+
+// Adds a line of range_summary output for a single run.
+static void merge_range_line(combination_t *combination, char *line, const char *filename, unsigned line_number)
+{
+    unsigned n_commas = 0;
+    for (const char *p = line; *p; ++p) {
+        if (*p == ',')
+            ++n_commas;
+    }
+    // The last two columns are the random number generator state.
+    if (n_commas < 3) {
+        fprintf(stderr, "Error parsing %s, line %u\n", filename, line_number);
+        exit(4);
+    }
+    check_columns(combination, n_commas - 1, filename);
+
+    char *p = line;
+    for (unsigned i = 0; i < combination->n_columns; ++i) {
+        while (*p != ',') {
+            char *end;
+            uint_fast64_t start = strtoull(p, &end, 10);
+            if (end == p || *end != '-') {
+                fprintf(stderr, "Error parsing range in %s, line %u\n", filename, line_number);
+                exit(4);
+            }
+            p = end + 1;
+            uint_fast64_t last = strtoull(p, &end, 10);
+            if (end == p || last < start || (*end != ':' && *end != ',')) {
+                fprintf(stderr, "Error parsing range in %s, line %u\n", filename, line_number);
+                exit(4);
+            }
+            p = end;
+            if (*p == ':')
+                ++p;
+
+            row_for_trial(combination, last); // Make sure there is room for every trial in the range.
+            for (uint_fast64_t t = start; t <= last; ++t)
+                combination->counts[(t * combination->n_columns) + i] += 1;
+        }
+        ++p;
+    }
+    ++(combination->n_runs);
+}
+
+static void merge_file(merged_t *merged, FILE *f, const char *filename)
+{
+    char *line = NULL;
+    size_t sz = 0;
+    bool in_aggregate_block = false;
+    // The combination which the lines are for, or -1 before any heading.
+    int combination = -1;
+    unsigned line_number = 0;
+    ssize_t len;
+    while ((len = getline(&line, &sz, f)) >= 0) {
+        ++line_number;
+        while (len > 0 && isspace(line[len-1]))
+            line[--len] = '\0';
+
+        if (len == 0) {
+            in_aggregate_block = false;
+            continue;
+        }
+
+        if (! strncmp(line, "language ", 9)) {
+            combination = find_combination(merged, line, filename, line_number);
+            in_aggregate_block = false;
+            continue;
+        }
+        if (combination < 0)
+            combination = find_combination(merged, NULL, filename, line_number);
+
+        uint_fast64_t n_runs;
+        if (sscanf(line, "runs,%llu", &n_runs) == 1) {
+            check_format(merged, INPUT_FORMAT_AGGREGATE, filename, line_number);
+            merged->combinations[combination].n_runs += n_runs;
+            in_aggregate_block = true;
+        }
+        else if (in_aggregate_block) {
+            merge_aggregate_line(merged->combinations + combination, line, filename, line_number);
+        }
+        else {
+            check_format(merged, INPUT_FORMAT_RANGE_SUMMARY, filename, line_number);
+            merge_range_line(merged->combinations + combination, line, filename, line_number);
+        }
+    }
+    if (ferror(f)) {
+        fprintf(stderr, "Error reading %s\n", filename);
+        exit(5);
+    }
+    free(line);
+}
+
+int main(int argc, char *argv[])
+{
+    bool fractions = false;
+    int argi = 1;
+    if (argi < argc && ! strcmp(argv[argi], "-f")) {
+        fractions = true;
+        ++argi;
+    }
+
+    merged_t merged;
+    memset(&merged, 0, sizeof(merged));
+
+    if (argi == argc) {
+        merge_file(&merged, stdin, "stdin");
+    }
+    for (; argi < argc; ++argi) {
+        FILE *f = fopen(argv[argi], "r");
+        if (! f) {
+            fprintf(stderr, "Error opening %s\n", argv[argi]);
+            exit(1);
+        }
+        merge_file(&merged, f, argv[argi]);
+        fclose(f);
+    }
+
+    if (merged.n_combinations == 0)
+        printf("runs,0\n");
+
+    for (unsigned k = 0; k < merged.n_combinations; ++k) {
+        combination_t *c = merged.combinations + k;
+        if (c->heading)
+            printf("%s\n", c->heading);
+        printf("runs,%llu\n", c->n_runs);
+        for (uint_fast64_t j = 0; j < c->n_trials; ++j) {
+            printf("%llu", j);
+            for (unsigned i = 0; i < c->n_columns; ++i) {
+                uint_fast64_t count = c->counts[(j * c->n_columns) + i];
+                if (fractions)
+                    printf(",%f", c->n_runs ? (double)count / c->n_runs : 0.0);
+                else
+                    printf(",%llu", count);
+            }
+            printf("\n");
+        }
+        free(c->heading);
+        free(c->counts);
+    }
+
+    free(merged.combinations);
+    return 0;
+}
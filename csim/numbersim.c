@@ -8,16 +8,138 @@
 // The corresponding output for each line is written to stdout immediately after
 // each line is read.
 //
+// If the environment variable NUMBERSIM_RECORD is set to a filename, each line
+// read from stdin is also written to that file as a trace line
+//
+//     ARRIVAL_US SERVICE_US ARGUMENTS
+//
+// where ARRIVAL_US is the time in microseconds from startup until the line was
+// read, and SERVICE_US is the time taken to run it and write its output. A
+// trace can be replayed using
+//
+//     numbersim --replay trace.txt
+//
+// which runs the requests one after the other as quickly as possible (ignoring
+// arrival times), discards their output, and prints the number of requests,
+// total time, throughput, latency percentiles and a 64-bit FNV-1a checksum of
+// the output that would have been written to stdout. An identical checksum
+// shows that a change to the simulator didn't change any results. A request
+// which fails (e.g. because its language file can't be found from the current
+// directory) is reported on stderr and counted, but left out of the checksum
+// and latencies, and the replay carries on (exiting with code 32 at the end).
+// The cache (see below) isn't used during a replay.
+//
+// If the environment variable NUMBERSIM_CACHE is set to a directory, the output
+// of each request is stored there, and repeated requests are answered from the
+// cache. The cache key is made from the parsed arguments and the definitions of
+// the languages used (rather than the name of the language file), so editing a
+// language only invalidates results for that language. NUMBERSIM_CACHE_MB sets
+// the maximum size of the cache in megabytes (default CACHE_DEFAULT_MAX_MB).
+// Least recently used results are deleted once the cache is full.
+//
+// A whole grid of simulations can be run in one process with
+//
+//     numbersim --sweep FILE SEED1:I-J SEED2 LANGUAGES RATES MAX_CUES TRIALS DISTRIBUTIONS [THREADS]
+//
+// e.g.
+//
+//     numbersim --sweep languages.txt 2000:0-999 3000 '*' 0.01+0.05 5+7 1000 ztnbd+random
+//
+// The first seven arguments are as below. LANGUAGES, RATES, MAX_CUES and
+// DISTRIBUTIONS are '+'-separated lists, and runs I to J of the partitioned
+// stream are run for every combination (cell) of them. DISTRIBUTIONS are
+// families of cue distributions rather than p values:
+//
+//     ztnbd              zero-truncated negative binomial with beta = 0.6
+//                        and r = 3 (as in sim.js)
+//     ztnbd:BETA:R       the same with other parameters
+//     uniform            every cardinality equally likely
+//     random             a different distribution for each run, drawn (as in
+//                        sim.js) from a generator seeded with SEED2 and
+//                        SEED1 and advanced to the run, so every cell gets
+//                        the same distribution for a given run
+//
+// Blocks of ENSEMBLE_BLOCK_SIZE runs are shared between THREADS threads
+// (default one per core). The counts are summed once all the runs are done,
+// so the output doesn't depend on the number of threads. The output is a
+// single CSV file in long format, with a heading line and then one line per
+// cell, trial and cardinality (1 to max_cue, or 'all'):
+//
+//     language,distribution,learning_rate,max_cue,trial,cardinality,runs,correct,fraction
+//
+// Language names are quoted, since they may contain commas.
+//
+// Many requests can be served by one long-running process with
+//
+//     numbersim --daemon SOCKET [THREADS]
+//
+// which listens on a Unix domain socket and runs requests on THREADS worker
+// threads (default one per core). See daemon.h for the protocol. Each worker
+// keeps its languages loaded between requests, and a bad request gets an
+// error response (with the exit code it would have caused) rather than
+// stopping the daemon. Relative language file names are relative to the
+// directory the daemon was started in. NUMBERSIM_CACHE and NUMBERSIM_RECORD
+// are ignored.
+//
 // Arguments (all required):
 //
 //     1)    Name of file containing language data.
 //     2)    First random seed (decimal integer between 0 and (2^64)-1 inclusive)
+//           This may be followed by ':I' or ':I-J' to run run I (or runs I to J
+//           inclusive) of a partitioned stream. Run I uses the generator seeded
+//           from the two seeds and then advanced by I * RUN_STREAM_STRIDE steps,
+//           so that its results depend only on the seeds and I. Run indices
+//           can be at most MAX_PARTITIONED_RUN (2^24 - 1), since later runs
+//           would repeat the streams of earlier ones. This allows
+//           a sequence of runs to be split into shards and then combined using
+//           numbersim-merge. Runs are output one after the other.
 //     3)    Second reandom seed (decimal integer between 0 and (2^64)-1 inclusive)
 //     4)    Language name
 //     5)    learning rate (typical value is 0.01)
+//
+//           Several languages and/or learning rates may be given as lists
+//           separated by '+' (e.g. 'a_sing:pl+dual:nondual' and '0.01+0.05'),
+//           and '*' means every language in the file. Every combination of
+//           language and learning rate is then run in lockstep on the same
+//           sequence of cues, which is drawn only once. The output for each
+//           combination follows a line 'language NAME learning_rate RATE'.
+//           The 'full' and 'trajectory' output modes can't be used with more
+//           than one combination.
 //     6)    Maximum cue cardinality (7 in original experiment).
 //     7)    Number of trials to run (decimal integer between 0 and (2^64)-1 inclusive)
-//     8)    Output mode (either 'full', 'summary' or 'range_summary')
+//     8)    Output mode (either 'full', 'summary', 'range_summary', 'aggregate'
+//           or 'trajectory')
+//           'aggregate' outputs a line 'runs,N' followed by one line per trial
+//           giving the trial number, the number of runs which got each
+//           cardinality right at that trial, and the number of runs which
+//           got every cardinality right.
+//           An early stopping rule can be appended:
+//               aggregate:until:W       (or aggregate:until:W:B)
+//           Runs are then added in blocks of B (default ENSEMBLE_BLOCK_SIZE)
+//           until the 95% Wilson confidence band for the fraction of runs
+//           which got every cardinality right is no wider than W at every
+//           trial, or the range of runs given by the first seed argument is
+//           used up. Since the rule is only checked between blocks, the
+//           result depends only on the arguments. The first line is then
+//           'runs,N,band_width,X', where N is the number of runs used and X
+//           is the widest band.
+//           In 'full' mode, a line is output for every trial by default. An
+//           output schedule can be appended to restrict output to some trials
+//           (the simulation itself still runs every trial):
+//               full:every:K         every K-th trial (0, K, 2K, ...)
+//               full:log:M           M log-spaced trials between 0 and n-1
+//               full:at:T1,T2,...    the listed trials (0-based)
+//           When a schedule is given, each line begins with its trial number.
+//           'trajectory' summarizes the 'full' output of every run in the
+//           range given by the first seed argument. It outputs a line
+//           'runs,N', a line of headings, and then one line per trial giving
+//           the trial number and the mean and sample variance over all runs
+//           of each compound cue association, of whether each cardinality was
+//           right (1 or 0) and of whether every cardinality was right. The
+//           means and variances are accumulated one run at a time (using
+//           Welford's method), so memory use doesn't depend on the number of
+//           runs. The same output schedules as for 'full' can be appended
+//           (e.g. 'trajectory:log:100').
 //     9)    If output mode is "summary', quit after all markers have been correct
 //           for at least this number of trials. If 0, never quit early.
 //           This value is ignored for other output modes.
@@ -35,178 +157,218 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <config.h>
-#include <parser.h>
 #include <pcg_basic.h>
+#include <libnumbersim.h>
+#include <cache.h>
+#include <daemon.h>
 #include <assert.h>
 #include <string.h>
 #include <stdbool.h>
 #include <ctype.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <stdarg.h>
 
-typedef enum output_mode {
-    OUTPUT_MODE_FULL,
-    OUTPUT_MODE_SUMMARY,
-    OUTPUT_MODE_RANGE_SUMMARY
-} output_mode_t;
-
-typedef struct state {
-    language_t language;
-    uint_fast64_t n_trials;
-    uint_fast32_t max_cue;
-    double assocs[MAX_CARDINALITY][MAX_MARKERS];
-    double compound_cue_assocs[MAX_CARDINALITY][MAX_MARKERS];
-    double learning_rate;
-    uint32_t thresholds[MAX_CARDINALITY];
-    pcg32_random_t rand_state;
-    output_mode_t output_mode;
-    uint_fast64_t marker_has_been_correct_for_last[MAX_CARDINALITY];
-    uint_fast64_t all_markers_have_been_correct_for_last;
-    // Array of bitfields for each cardinality.
-    uint8_t *correct_at[MAX_CARDINALITY];
-    unsigned quit_after_n_correct;
-} state_t;
-
-static void update_state_for_marker(state_t *state, unsigned marker_index, uint_fast32_t cardinality, double l)
-{
-    double vax = 0;
-    for (unsigned i = 0; i <= cardinality; ++i) {
-        vax += state->assocs[i][marker_index];
-    }
-
-    double delta_v = state->learning_rate * (l - vax);
-
-    for (unsigned i = 0; i <= cardinality; ++i) {
-        //printf("ADDING card=%i, marker=%i, raw_index=%u, +%f [%f]\n", i, marker_index, (i * state->language.num_markers) + marker_index, delta_v, l);
-        state->assocs[i][marker_index] += delta_v;
-    }
-}
-
-static bool update_state(state_t *state, unsigned marker_index, uint_fast32_t cardinality)
-{
-    for (unsigned i = 0; i < state->language.num_markers; ++i) {
-        update_state_for_marker(state, i, cardinality, i == marker_index ? 1.0 : 0.0);
-    }
-
-    unsigned correct_for = 0;
-    for (unsigned i = 0; i < state->max_cue; ++i) {
-        double max_sum = 0.0;
-        unsigned max_sum_marker_index;
-        for (unsigned j = 0; j < state->language.num_markers; ++j) {
-            double sum = 0.0;
-            for (unsigned k = 0; k <= i; ++k)
-                sum += state->assocs[k][j];
-            if (sum > max_sum) {
-                max_sum = sum;
-                max_sum_marker_index = j;
-            }
-            state->compound_cue_assocs[i][j] = sum;
-        }
-        if (max_sum_marker_index == state->language.n_to_marker[i]) {
-            ++correct_for;
-            ++(state->marker_has_been_correct_for_last[i]);
-            state->correct_at[i][state->n_trials / 8] |= (1 << (state->n_trials % 8));
-        }
-        else {
-            state->marker_has_been_correct_for_last[i] = 0;
-        }
-    }
+// Where simulation output goes. This is stdout except when replaying a trace,
+// writing a cache entry or running a request for the daemon, which has a
+// separate output for each worker thread.
+static _Thread_local FILE *output;
+// NULL unless NUMBERSIM_CACHE is set (and never used by the daemon).
+static cache_t *cache;
 
-    if (correct_for == state->max_cue) {
-        ++(state->all_markers_have_been_correct_for_last);
+// Exit codes for errors returned by libnumbersim.
+static int exit_code_for_error(ns_error_t error)
+{
+    switch (error) {
+    case NS_ERROR_LANGUAGE_FILE:     return 1;
+    case NS_ERROR_BAD_LEARNING_RATE: return 8;
+    case NS_ERROR_BAD_MAX_CUE:       return 11;
+    case NS_ERROR_BAD_DISTRIBUTION:  return 17;
+    case NS_ERROR_UNKNOWN_LANGUAGE:  return 19;
+    case NS_ERROR_TOO_MANY_TRIALS:   return 25;
+    case NS_ERROR_OUT_OF_MEMORY:     return 26;
+    case NS_ERROR_INCOMPATIBLE_STATES: return 28;
+    default:                         return 27;
     }
-    else {
-        state->all_markers_have_been_correct_for_last = 0;
+}
+
+// Set while a daemon worker is running a request.
+static _Thread_local jmp_buf *request_error_jump;
+static _Thread_local int request_error_code;
+static _Thread_local char request_error_message[256];
+
+// Reports a bad request. Normally this prints the message and exits with the
+// given code. In the daemon, the request fails instead, and the message and
+// code are sent back to the client.
+static void request_error(int exit_code, const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    if (request_error_jump) {
+        vsnprintf(request_error_message, sizeof(request_error_message), format, args);
+        va_end(args);
+        request_error_code = exit_code;
+        longjmp(*request_error_jump, 1);
     }
+    vfprintf(stderr, format, args);
+    va_end(args);
+    fprintf(stderr, "\n");
+    exit(exit_code);
+}
+
+typedef enum output_schedule_kind {
+    OUTPUT_SCHEDULE_ALL,
+    OUTPUT_SCHEDULE_EVERY,
+    OUTPUT_SCHEDULE_LOG,
+    OUTPUT_SCHEDULE_LIST
+} output_schedule_kind_t;
 
-    if (state->output_mode == OUTPUT_MODE_SUMMARY) {
-        // Check if we should quit now.
-        return (state->quit_after_n_correct == 0 ||
-                (state->all_markers_have_been_correct_for_last < state->quit_after_n_correct));
+#define OUTPUT_SCHEDULE_NEVER UINT_FAST64_MAX
+
+typedef struct output_schedule {
+    output_schedule_kind_t kind;
+    // K for OUTPUT_SCHEDULE_EVERY, M for OUTPUT_SCHEDULE_LOG,
+    // length of 'trials' for OUTPUT_SCHEDULE_LIST.
+    uint_fast64_t n;
+    // Sorted list of trials for OUTPUT_SCHEDULE_LIST.
+    uint_fast64_t *trials;
+    // Index of the next log point or list entry to consider. Trials are
+    // always requested in increasing order, so this never goes backwards.
+    uint_fast64_t cursor;
+} output_schedule_t;
+
+
+// Trial number of the kth of m log-spaced points between 0 and n-1.
+static uint_fast64_t log_spaced_trial(uint_fast64_t k, uint_fast64_t m, uint_fast64_t n)
+{
+    if (k == 0 || m <= 1)
+        return 0;
+    if (k >= m - 1)
+        return n - 1;
+    uint_fast64_t t = (uint_fast64_t)floor(pow((double)n, (double)k / (double)(m - 1))) - 1;
+    return t < n - 1 ? t : n - 1;
+}
+
+// Returns the first scheduled trial which is >= 'from', or
+// OUTPUT_SCHEDULE_NEVER if there is none.
+static uint_fast64_t next_scheduled_trial(output_schedule_t *schedule, uint_fast64_t from, uint_fast64_t n_trials)
+{
+    switch (schedule->kind) {
+    case OUTPUT_SCHEDULE_ALL:
+        return from;
+    case OUTPUT_SCHEDULE_EVERY: {
+        // Round 'from' up to a multiple of n, checking that it fits.
+        uint_fast64_t gap = (schedule->n - from % schedule->n) % schedule->n;
+        if (from >= OUTPUT_SCHEDULE_NEVER - gap)
+            return OUTPUT_SCHEDULE_NEVER;
+        return from + gap;
     }
-    else {
-        return true; // Continue running.
+    case OUTPUT_SCHEDULE_LOG:
+        for (; schedule->cursor < schedule->n; ++(schedule->cursor)) {
+            uint_fast64_t t = log_spaced_trial(schedule->cursor, schedule->n, n_trials);
+            if (t >= from)
+                return t;
+        }
+        return OUTPUT_SCHEDULE_NEVER;
+    case OUTPUT_SCHEDULE_LIST:
+        for (; schedule->cursor < schedule->n; ++(schedule->cursor)) {
+            if (schedule->trials[schedule->cursor] >= from)
+                return schedule->trials[schedule->cursor];
+        }
+        return OUTPUT_SCHEDULE_NEVER;
     }
+    assert(false);
+    return OUTPUT_SCHEDULE_NEVER;
 }
 
-static void output_headings(const state_t *state)
+static void output_headings(const ns_state_t *state, const output_schedule_t *schedule)
 {
-    printf("trial");
-    for (unsigned i = 0; i < state->max_cue; ++i) {
-        for (unsigned j = 0; j < state->language.num_markers; ++j) {
-            printf(",%i->%s", i+1, state->language.markers[j]);
+    fprintf(output, "trial");
+    if (schedule->kind != OUTPUT_SCHEDULE_ALL)
+        fprintf(output, ",cue");
+    for (unsigned i = 0; i < ns_max_cue(state); ++i) {
+        for (unsigned j = 0; j < ns_marker_count(state); ++j) {
+            fprintf(output, ",%i->%s", i+1, ns_marker_name(state, j));
         }
-        printf(",%i_correct", i+1);
+        fprintf(output, ",%i_correct", i+1);
     }
-    printf(",seed1,seed2\n");
+    fprintf(output, ",seed1,seed2\n");
 }
 
-static void output_line(const state_t *state, int marker_index, uint_fast32_t cardinality)
+static void output_rand_state(const ns_state_t *state, const char *end)
 {
-    printf("%s %i", (marker_index == - 1 ? "" : state->language.markers[marker_index]), cardinality+1);
-    for (unsigned i = 0; i < state->max_cue; ++i) {
-        for (unsigned j = 0; j < state->language.num_markers; ++j) {
-            printf(",%f", state->compound_cue_assocs[i][j]);
+    uint64_t rand_state, inc;
+    ns_rand_state(state, &rand_state, &inc);
+    fprintf(output, ",%llu,%llu%s", rand_state, inc, end);
+}
+
+static void output_line(const ns_state_t *state, const output_schedule_t *schedule, int marker_index, uint_fast32_t cardinality)
+{
+    // With a schedule, the line number no longer identifies the trial.
+    if (schedule->kind != OUTPUT_SCHEDULE_ALL)
+        fprintf(output, "%llu,", ns_trials_run(state));
+    fprintf(output, "%s %i", (marker_index == - 1 ? "" : ns_marker_name(state, marker_index)), cardinality+1);
+    const unsigned n_markers = ns_marker_count(state);
+    double assocs[MAX_CARDINALITY * MAX_MARKERS];
+    ns_compound_cue_assocs(state, assocs);
+    for (unsigned i = 0; i < ns_max_cue(state); ++i) {
+        for (unsigned j = 0; j < n_markers; ++j) {
+            fprintf(output, ",%f", assocs[(i * n_markers) + j]);
         }
-        printf(",%llu", state->marker_has_been_correct_for_last[i]);
+        fprintf(output, ",%llu", ns_correct_for(state, i));
     }
-    printf(",%llu,%llu\n", state->rand_state.state, state->rand_state.inc);
+    output_rand_state(state, "\n");
 }
 
-static void output_summary(const state_t *state)
+static void output_summary(const ns_state_t *state)
 {
     // Output the number of trials which it took to get the right marker
-    // for each cardinality for a sequence of at least the specified number of
-    // trials.
-    for (unsigned i = 0; i < state->max_cue; ++i) {
+    // for each cardinality (and then for all cardinalities) for a sequence of
+    // at least the specified number of trials.
+    uint64_t trials[MAX_CARDINALITY + 1];
+    ns_trials_to_criterion(state, trials);
+    for (unsigned i = 0; i <= ns_max_cue(state); ++i) {
         if (i != 0)
-            printf(",");
-
-        uint_fast64_t correct_for = state->marker_has_been_correct_for_last[i];
-        if (correct_for < state->quit_after_n_correct)
-            // This marker was never correct for the required number of trials.
-            printf("%llu", state->n_trials);
-        else
-            printf("%llu", state->n_trials - state->marker_has_been_correct_for_last[i]);
+            fprintf(output, ",");
+        fprintf(output, "%llu", trials[i]);
     }
 
-    // For all cardinalities.
-    if (state->all_markers_have_been_correct_for_last < state->quit_after_n_correct)
-        printf(",%llu", state->n_trials);
-    else
-        printf(",%llu", state->n_trials - state->all_markers_have_been_correct_for_last);
-
     // Output seed state for random number generator (so that subsequent runs
     // can use them as the starting point).
-    printf(",%llu,%llu\n", state->rand_state.state, state->rand_state.inc);
+    output_rand_state(state, "\n");
 }
 
-static void output_range_summary(const state_t *state)
+static void output_range_summary(const ns_state_t *state)
 {
+    const uint64_t n_trials = ns_trials_run(state);
+
     // We want to print numbers in ranges with a constant number of digits
     // to make sorting easier. So we need to find the number of digits
-    // required to print state->n_trials - 1. See:
+    // required to print n_trials - 1. See:
     //     http://stackoverflow.com/a/7200873/376854
     // for an explanation of this cute trick.
-    unsigned num_digits = snprintf(0, 0, "%llu", state->n_trials);
+    unsigned num_digits = snprintf(0, 0, "%llu", n_trials);
 
-    // For each cardinality, output the number of simulations which got
-    // it right for each n trials (using ranges to make the output more compact).
-    for (unsigned i = 0; i < state->max_cue; ++i) {
+    // For each cardinality (and then for every cardinality at once), output
+    // the number of simulations which got it right for each n trials (using
+    // ranges to make the output more compact).
+    for (unsigned i = 0; i <= ns_max_cue(state); ++i) {
         if (i != 0)
-            printf(",");
+            fprintf(output, ",");
         
         uint_fast64_t start = 0;
         uint_fast64_t num_ranges = 0;
         uint_fast64_t j;
-        uint_fast8_t v = 0;
-        for (j = 0; j < state->n_trials; ++j) {
-            v = state->correct_at[i][j/8];
-            v >>= (j % 8);
-            v &= 1;
+        bool v = false;
+        for (j = 0; j < n_trials; ++j) {
+            v = ns_was_correct_at(state, i, j);
             if (! v) {
                 if (j - start > 1) {
                     if (num_ranges != 0)
-                        printf(":");
-                    printf("%0*llu-%0*llu", num_digits, start, num_digits, j-1);
+                        fprintf(output, ":");
+                    fprintf(output, "%0*llu-%0*llu", num_digits, start, num_digits, j-1);
                     ++num_ranges;
                 }
                 start = j;
@@ -214,82 +376,325 @@ static void output_range_summary(const state_t *state)
         }
         if (v) {
              if (num_ranges > 0)
-                 printf(":");
-             printf("%0*llu-%0*llu", num_digits, start, num_digits, j-1);
-        }
-    }
-    printf(",");
-    // Same thing but right for every cardinality for n trials.
-    uint_fast64_t start = 0;
-    uint_fast64_t num_ranges = 0;
-    uint_fast64_t j;
-    uint_fast8_t v = 0;
-    for (j = 0; j < state->n_trials; ++j) {
-        v = 1;
-        for (unsigned c = 0; c < state->max_cue; ++c) {
-            uint_fast8_t vv = state->correct_at[c][j/8];
-            vv >>= (j % 8);
-            vv &= 1;
-            v &= vv;
-        }
-        if (! v) {
-            if (j - start > 1) {
-                if (num_ranges != 0)
-                    printf(":");
-                printf("%0*llu-%0*llu", num_digits, start, num_digits, j-1);
-                ++num_ranges;
-            }
-            start = j;
-        } 
-    }
-    if (v) {
-        if (num_ranges > 0)
-            printf(":");
-        printf("%0*llu-%0*llu", num_digits, start, num_digits, j-1);
+                 fprintf(output, ":");
+             fprintf(output, "%0*llu-%0*llu", num_digits, start, num_digits, j-1);
+        }
     }
 
     // Output seed state for random number generator (so that subsequent runs
     // can use them as the starting point).
-    printf(",%llu,%llu\n\n", state->rand_state.state, state->rand_state.inc);
+    output_rand_state(state, "\n\n");
 }
 
-static void run_trials(state_t *state, uint_fast64_t n)
+typedef struct stopping_rule {
+    // 0 if runs should not stop early.
+    double max_band_width;
+    uint_fast64_t block_size;
+} stopping_rule_t;
+
+// Width of the 95% Wilson score interval for a proportion of
+// successes out of n. Unlike the normal approximation, this doesn't collapse to
+// zero when every run (or no run) succeeds.
+static double wilson_band_width(uint64_t successes, uint64_t n)
 {
-    if (state->output_mode == OUTPUT_MODE_FULL)
-        output_headings(state);
+    const double z = 1.959964;
+    double p = (double)successes / n;
+    double z2n = (z * z) / n;
+    return (2 * z * sqrt((p * (1 - p) / n) + (z2n / (4 * n)))) / (1 + z2n);
+}
 
-    uint_fast32_t card = 0;
-    int marker_index = -1;
-    for (; state->n_trials < n; ++(state->n_trials)) {
-        if (state->output_mode == OUTPUT_MODE_FULL)
-            output_line(state, marker_index, card);
+// Widest confidence band over all trials for the 'all cardinalities' column
+// of counts filled in by ns_add_correct_counts().
+static double max_band_width(const ns_state_t *state, const uint64_t *counts, uint64_t n_runs)
+{
+    const uint64_t n_trials = ns_max_trials(state);
+    const uint64_t *all = counts + (ns_max_cue(state) * n_trials);
+    double max = 0.0;
+    for (uint_fast64_t j = 0; j < n_trials; ++j) {
+        double w = wilson_band_width(all[j], n_runs);
+        if (w > max)
+            max = w;
+    }
+    return max;
+}
 
-        uint32_t r = pcg32_random_r(&(state->rand_state));
+// Parses the part of an 'aggregate' output mode argument following
+// "aggregate".
+static void parse_stopping_rule(const char *spec, stopping_rule_t *rule)
+{
+    rule->max_band_width = 0;
+    rule->block_size = ENSEMBLE_BLOCK_SIZE;
 
-        // Determine the cardinality of the cue based on the random number.
-        for (card = 0; card < state->max_cue - 1 && r >= state->thresholds[card]; ++card);
+    if (spec[0] == '\0')
+        return;
 
-        // Get the appropriate marker for that cardinality.
-        marker_index = state->language.n_to_marker[card];
-        assert(marker_index >= 0);
+    char junk;
+    if (sscanf(spec, ":until:%lf%c", &(rule->max_band_width), &junk) != 1 &&
+        sscanf(spec, ":until:%lf:%llu%c", &(rule->max_band_width), &(rule->block_size), &junk) != 2) {
+        request_error(31, "Bad stopping rule '%s' (should be \":until:W\" or \":until:W:B\")", spec);
+    }
+    if (! (rule->max_band_width > 0) || rule->block_size == 0) {
+        request_error(31, "Band width and block size for stopping rule must be greater than 0");
+    }
+}
 
-        if (! update_state(state, marker_index, card))
-            break;
+// 'counts' is as filled in by ns_add_correct_counts().
+static void output_aggregate(const ns_state_t *state, const uint64_t *counts, uint_fast64_t n_runs, const stopping_rule_t *rule)
+{
+    const uint64_t n_trials = ns_max_trials(state);
+    fprintf(output, "runs,%llu", n_runs);
+    if (rule->max_band_width > 0)
+        fprintf(output, ",band_width,%f", max_band_width(state, counts, n_runs));
+    fprintf(output, "\n");
+    for (uint_fast64_t j = 0; j < n_trials; ++j) {
+        fprintf(output, "%llu", j);
+        for (unsigned i = 0; i <= ns_max_cue(state); ++i)
+            fprintf(output, ",%llu", counts[(i * n_trials) + j]);
+        fprintf(output, "\n");
     }
+}
 
-    if (state->output_mode == OUTPUT_MODE_SUMMARY)
+typedef struct full_output {
+    output_schedule_t *schedule;
+    uint_fast64_t next_output_trial;
+} full_output_t;
+
+static void output_scheduled_line(void *data, const ns_state_t *state, int marker_index, uint_fast32_t cardinality)
+{
+    full_output_t *out = data;
+    uint64_t trial = ns_trials_run(state);
+    if (trial == out->next_output_trial) {
+        output_line(state, out->schedule, marker_index, cardinality);
+        out->next_output_trial = next_scheduled_trial(out->schedule, trial + 1, ns_max_trials(state));
+    }
+}
+
+static void output_run(const ns_state_t *state, ns_output_mode_t output_mode)
+{
+    if (output_mode == NS_OUTPUT_MODE_SUMMARY)
         output_summary(state);
-    else if (state->output_mode == OUTPUT_MODE_RANGE_SUMMARY)
+    else if (output_mode == NS_OUTPUT_MODE_RANGE_SUMMARY)
         output_range_summary(state);
 
-    fflush(stdout);
+    fflush(output);
+}
+
+static void run_and_output_trials(ns_state_t *state, ns_output_mode_t output_mode, output_schedule_t *schedule)
+{
+    if (output_mode == NS_OUTPUT_MODE_FULL) {
+        output_headings(state, schedule);
+        schedule->cursor = 0;
+        full_output_t out = { schedule, next_scheduled_trial(schedule, 0, ns_max_trials(state)) };
+        ns_run(state, output_scheduled_line, &out);
+    }
+    else {
+        ns_run(state, NULL, NULL);
+    }
+
+    output_run(state, output_mode);
+}
+
+typedef struct trajectory {
+    output_schedule_t *schedule;
+    uint_fast64_t next_output_trial;
+    // Row for the next scheduled trial of the current run.
+    uint_fast64_t row;
+    uint_fast64_t n_rows;
+    // max_cue * (num_markers + 1) + 1 values for each row.
+    unsigned n_columns;
+    // Number of runs started so far.
+    uint_fast64_t n_runs;
+    // The trial for each row.
+    uint_fast64_t *trials;
+    // Running mean and sum of squared differences from the mean for each
+    // value of each row.
+    double *means;
+    double *m2s;
+} trajectory_t;
+
+static void free_trajectory(trajectory_t *trajectory)
+{
+    free(trajectory->trials);
+    free(trajectory->means);
+    free(trajectory->m2s);
+}
+
+static bool init_trajectory(trajectory_t *trajectory, const ns_state_t *state, output_schedule_t *schedule)
+{
+    const uint64_t n_trials = ns_max_trials(state);
+    trajectory->schedule = schedule;
+    trajectory->n_columns = (ns_max_cue(state) * (ns_marker_count(state) + 1)) + 1;
+    trajectory->n_runs = 0;
+
+    trajectory->n_rows = 0;
+    schedule->cursor = 0;
+    for (uint_fast64_t t = next_scheduled_trial(schedule, 0, n_trials); t < n_trials; t = next_scheduled_trial(schedule, t + 1, n_trials))
+        ++(trajectory->n_rows);
+
+    size_t n_values = trajectory->n_rows * trajectory->n_columns;
+    trajectory->trials = malloc(trajectory->n_rows * sizeof(uint_fast64_t));
+    trajectory->means = calloc(n_values, sizeof(double));
+    trajectory->m2s = calloc(n_values, sizeof(double));
+    if ((trajectory->n_rows > 0 && ! trajectory->trials) ||
+        (n_values > 0 && (! trajectory->means || ! trajectory->m2s))) {
+        free_trajectory(trajectory);
+        return false;
+    }
+    return true;
+}
+
+// To be called before each run.
+static void start_trajectory_run(trajectory_t *trajectory, const ns_state_t *state)
+{
+    ++(trajectory->n_runs);
+    trajectory->row = 0;
+    trajectory->schedule->cursor = 0;
+    trajectory->next_output_trial = next_scheduled_trial(trajectory->schedule, 0, ns_max_trials(state));
+}
+
+static void add_trajectory_value(const trajectory_t *trajectory, size_t index, double x)
+{
+    double delta = x - trajectory->means[index];
+    trajectory->means[index] += delta / trajectory->n_runs;
+    trajectory->m2s[index] += delta * (x - trajectory->means[index]);
+}
+
+static void accumulate_trajectory(void *data, const ns_state_t *state, int marker_index, uint_fast32_t cardinality)
+{
+    (void)marker_index;
+    (void)cardinality;
+    trajectory_t *trajectory = data;
+    uint64_t trial = ns_trials_run(state);
+    if (trial != trajectory->next_output_trial)
+        return;
+
+    trajectory->trials[trajectory->row] = trial;
+    const unsigned max_cue = ns_max_cue(state), n_markers = ns_marker_count(state);
+    double assocs[MAX_CARDINALITY * MAX_MARKERS];
+    ns_compound_cue_assocs(state, assocs);
+    size_t index = trajectory->row * trajectory->n_columns;
+    for (unsigned i = 0; i < max_cue; ++i) {
+        for (unsigned j = 0; j < n_markers; ++j)
+            add_trajectory_value(trajectory, index++, assocs[(i * n_markers) + j]);
+        add_trajectory_value(trajectory, index++, ns_correct_for(state, i) > 0);
+    }
+    add_trajectory_value(trajectory, index, ns_correct_for(state, max_cue) > 0);
+
+    ++(trajectory->row);
+    trajectory->next_output_trial = next_scheduled_trial(trajectory->schedule, trial + 1, ns_max_trials(state));
+}
+
+static void output_trajectory(const ns_state_t *state, const trajectory_t *trajectory)
+{
+    fprintf(output, "runs,%llu\ntrial", trajectory->n_runs);
+    for (unsigned i = 0; i < ns_max_cue(state); ++i) {
+        for (unsigned j = 0; j < ns_marker_count(state); ++j)
+            fprintf(output, ",%i->%s_mean,%i->%s_var", i+1, ns_marker_name(state, j), i+1, ns_marker_name(state, j));
+        fprintf(output, ",%i_correct_mean,%i_correct_var", i+1, i+1);
+    }
+    fprintf(output, ",all_correct_mean,all_correct_var\n");
+
+    for (uint_fast64_t r = 0; r < trajectory->n_rows; ++r) {
+        fprintf(output, "%llu", trajectory->trials[r]);
+        for (unsigned c = 0; c < trajectory->n_columns; ++c) {
+            size_t index = (r * trajectory->n_columns) + c;
+            double variance = trajectory->n_runs > 1 ? trajectory->m2s[index] / (trajectory->n_runs - 1) : 0.0;
+            fprintf(output, ",%f,%f", trajectory->means[index], variance);
+        }
+        fprintf(output, "\n");
+    }
+    fflush(output);
+}
+
+static void output_combination_heading(const ns_state_t *state, const char *learning_rate)
+{
+    fprintf(output, "language %s learning_rate %s\n", ns_state_language(state), learning_rate);
+}
+
+static int compare_trials(const void *a, const void *b)
+{
+    uint_fast64_t x = *(const uint_fast64_t *)a, y = *(const uint_fast64_t *)b;
+    return x < y ? -1 : (x > y);
+}
+
+// Parses the part of a 'full' output mode argument following "full".
+static void parse_output_schedule(const char *spec, output_schedule_t *schedule)
+{
+    schedule->kind = OUTPUT_SCHEDULE_ALL;
+    schedule->n = 0;
+    schedule->trials = NULL;
+    schedule->cursor = 0;
 
-    for (unsigned i = 0; i < MAX_CARDINALITY; ++i)
-        free(state->correct_at[i]);
+    if (spec[0] == '\0')
+        return;
+
+    // %llu would accept a negative number (and wrap it around).
+    if (strchr(spec, '-')) {
+        request_error(23, "Bad output schedule '%s' (trial numbers can't be negative)", spec);
+    }
+
+    char junk;
+    if (sscanf(spec, ":every:%llu%c", &(schedule->n), &junk) == 1) {
+        if (schedule->n == 0) {
+            request_error(21, "Output schedule interval must be greater than 0");
+        }
+        schedule->kind = OUTPUT_SCHEDULE_EVERY;
+    }
+    else if (sscanf(spec, ":log:%llu%c", &(schedule->n), &junk) == 1) {
+        if (schedule->n == 0) {
+            request_error(21, "Number of log-spaced output trials must be greater than 0");
+        }
+        schedule->kind = OUTPUT_SCHEDULE_LOG;
+    }
+    else if (! strncmp(spec, ":at:", 4)) {
+        const char *p = spec + 4;
+        uint_fast64_t n = 1;
+        for (const char *q = p; *q; ++q) {
+            if (*q == ',')
+                ++n;
+        }
+        schedule->kind = OUTPUT_SCHEDULE_LIST;
+        schedule->trials = malloc(n * sizeof(uint_fast64_t));
+        if (! schedule->trials)
+            request_error(exit_code_for_error(NS_ERROR_OUT_OF_MEMORY), "%s", ns_error_string(NS_ERROR_OUT_OF_MEMORY));
+        for (schedule->n = 0; schedule->n < n; ++(schedule->n)) {
+            int consumed;
+            if (sscanf(p, "%llu%n", schedule->trials + schedule->n, &consumed) < 1 ||
+                (p[consumed] != ',' && p[consumed] != '\0')) {
+                free(schedule->trials);
+                schedule->trials = NULL;
+                request_error(22, "Error parsing list of output trials '%s'", spec + 4);
+            }
+            p += consumed + 1;
+        }
+        qsort(schedule->trials, schedule->n, sizeof(uint_fast64_t), compare_trials);
+    }
+    else {
+        request_error(23, "Bad output schedule '%s' (should be \":every:K\", \":log:M\" or \":at:T1,T2,...\")", spec);
+    }
 }
 
 #define ARGS_STRING_MAX_LENGTH (1024*8)
 #define MAX_ARGS 100
+#define MAX_LEARNING_RATES 50
+#define MAX_SWEEP_DISTRIBUTIONS 20
+
+// Splits a '+'-separated list in place. Returns the number of items, or 0 if
+// there are more than max_items.
+static unsigned split_list(char *str, char *items[], unsigned max_items)
+{
+    unsigned n = 0;
+    for (;;) {
+        if (n >= max_items)
+            return 0;
+        items[n++] = str;
+        char *plus = strchr(str, '+');
+        if (! plus)
+            return n;
+        *plus = '\0';
+        str = plus + 1;
+    }
+}
 
 static unsigned string_to_arg_array(char *str, char *arg_array[])
 {
@@ -314,8 +719,7 @@ static unsigned string_to_arg_array(char *str, char *arg_array[])
     }
 
     if (str[i]) {
-        fprintf(stderr, "Too many arguments (max is %u)\n", ARGS_STRING_MAX_LENGTH);
-        exit(1);
+        request_error(1, "Too many arguments (max is %u)", ARGS_STRING_MAX_LENGTH);
     }
 
     return aai;
@@ -329,153 +733,876 @@ struct ASSERT_UNSIGNED_LONG_LONG_IS_AT_LEAST_64_BIT_STRUCT {
     int ASSERT_UNSIGNED_LONG_LONG_IS_AT_LEAST_64_BIT[(int)sizeof(unsigned long long) - (int)sizeof(uint64_t)];
 };
 
-// Guaranteed to be initialized to all zeroes. This will have the consequence
-// that the name of the first language will initially be the empty string.
-static language_t languages[MAX_LANGUAGES];
-
-static void run_given_arguments(int num_args, char **args)
+// Returns a string describing everything that the output of a request depends
+// on, for use as a cache key. The caller must free it. Returns NULL if out of
+// memory.
+static char *make_cache_key(ns_state_t *const *states, unsigned n_states, char *learning_rate_strings[], unsigned n_learning_rates,
+                            const ns_config_t *config, uint64_t first_run, uint64_t last_run, const char *output_mode_string)
 {
-    if (num_args < 12) {
-        fprintf(stderr, "Not enough arguments\n");
-        exit(2);
+    char *key = NULL;
+    size_t size = 0;
+    FILE *f = open_memstream(&key, &size);
+    if (! f)
+        return NULL;
+
+    fprintf(f, "v%u seeds %llu %llu", CACHE_FORMAT_VERSION, config->seed1, config->seed2);
+    if (config->partitioned)
+        fprintf(f, ":%llu-%llu", first_run, last_run);
+
+    // Only the parts of each language definition which the simulation uses.
+    for (unsigned i = 0; i < n_states; i += n_learning_rates) {
+        fprintf(f, " language %s", ns_state_language(states[i]));
+        for (unsigned j = 0; j < ns_marker_count(states[i]); ++j)
+            fprintf(f, "%c%s", j == 0 ? ':' : ',', ns_marker_name(states[i], j));
+        for (unsigned j = 0; j < config->max_cue; ++j)
+            fprintf(f, "%c%i", j == 0 ? ':' : ',', ns_correct_marker(states[i], j));
     }
 
-    static state_t state;
-    state.n_trials = 0;
+    // Learning rates as given, since they are included in the output.
+    fprintf(f, " learning_rates");
+    for (unsigned i = 0; i < n_learning_rates; ++i)
+        fprintf(f, "%c%s", i == 0 ? ' ' : '+', learning_rate_strings[i]);
 
-    const char *language_file_name = args[0];
+    fprintf(f, " max_cue %u trials %llu mode %s quit %u distribution", config->max_cue, config->n_trials, output_mode_string, config->quit_after_n_correct);
+    for (unsigned i = 0; i < config->max_cue - 1; ++i)
+        fprintf(f, " %a", config->distribution[i]);
 
-    // Get random seed from first and second arguments.
-    uint64_t seed1, seed2;
-    if (sscanf(args[1], "%llu", &seed1) < 1) {
-        fprintf(stderr, "Error parsing first random seed '%s' (second argument)\n", args[1]);
-        exit(3);
-    }
-    if (sscanf(args[2], "%llu", &seed2) < 1) {
-        fprintf(stderr, "Error parsing second random seed '%s' (third argument)\n", args[2]);
-        exit(4);
+    fclose(f);
+    return key;
+}
+
+// Frees what run_given_arguments() allocates, given the number of states
+// which have been initialized.
+static void free_request(ns_state_t **states, unsigned n_states, uint64_t *aggregate_counts, output_schedule_t *schedule)
+{
+    for (unsigned i = 0; i < n_states; ++i)
+        ns_state_free(states[i]);
+    free(states);
+    free(aggregate_counts);
+    free(schedule->trials);
+    schedule->trials = NULL;
+}
+
+static void run_given_arguments(ns_context_t *ctx, int num_args, char **args)
+{
+    if (num_args < 12) {
+        request_error(2, "Not enough arguments");
     }
 
-    seed2 |= 1; // Ensure that seed2 is odd, as required by pcg library.
-    pcg32_srandom_r(&(state.rand_state), seed1, seed2);
+    ns_config_t config;
+    output_schedule_t output_schedule = { OUTPUT_SCHEDULE_ALL, 0, NULL, 0 };
+    stopping_rule_t stopping_rule = { 0, 0 };
 
-    const char *language_name = args[3];
+    config.language_file = args[0];
 
-    if (sscanf(args[4], "%lf", &(state.learning_rate)) < 1) {
-        fprintf(stderr, "Error parsing learning_rate (fifth argument)\n");
-        exit(7);
+    // Get random seed (and optionally a range of runs) from first and second
+    // arguments.
+    uint64_t first_run = 0, last_run = 0;
+    int n_seed_parts = sscanf(args[1], "%llu:%llu-%llu", &(config.seed1), &first_run, &last_run);
+    if (n_seed_parts < 1) {
+        request_error(3, "Error parsing first random seed '%s' (second argument)", args[1]);
+    }
+    config.partitioned = n_seed_parts > 1;
+    if (n_seed_parts == 2)
+        last_run = first_run;
+    if (last_run < first_run) {
+        request_error(24, "Bad range of runs '%s' (second argument)", args[1]);
+    }
+    if (last_run > MAX_PARTITIONED_RUN) {
+        request_error(24, "Run index in '%s' is too big (max is %llu)", args[1], MAX_PARTITIONED_RUN);
     }
-    if (state.learning_rate <= 0) {
-        fprintf(stderr, "Bad value for learning_rate (must be > 0)\n");
-        exit(8);
+    if (sscanf(args[2], "%llu", &(config.seed2)) < 1) {
+        request_error(4, "Error parsing second random seed '%s' (third argument)", args[2]);
     }
 
-    if (sscanf(args[5], "%u", &(state.max_cue)) < 1) {
-        fprintf(stderr, "Error parsing max_cue (sixth argument)\n");
-        exit(9);
+    // Languages and learning rates.
+    char *language_names[MAX_LANGUAGES];
+    unsigned n_languages;
+    if (! strcmp(args[3], "*")) {
+        ns_error_t error = ns_load_languages(ctx, config.language_file);
+        if (error != NS_OK) {
+            request_error(exit_code_for_error(error), "%s", ns_context_error(ctx));
+        }
+        n_languages = ns_language_count(ctx);
+        for (unsigned i = 0; i < n_languages; ++i)
+            language_names[i] = (char *)ns_language_name(ctx, i);
     }
-    if (state.max_cue == 0) {
-        fprintf(stderr, "max_cue (sixth argument) must be greater than 0\n");
-        exit(10);
+    else {
+        n_languages = split_list(args[3], language_names, MAX_LANGUAGES);
     }
-    if (state.max_cue > MAX_CARDINALITY) {
-        fprintf(stderr, "Value of max_cue (sixth argument) is too big.\n");
-        exit(11);
+    if (n_languages == 0) {
+        request_error(29, "Bad list of languages (fourth argument)");
     }
 
-    uint_fast64_t num_trials;
-    if (sscanf(args[6], "%llu", &num_trials) < 1) {
-        fprintf(stderr, "Error parsing number of trials (seventh argument)\n");
-        exit(12);
+    char *learning_rate_strings[MAX_LEARNING_RATES];
+    double learning_rates[MAX_LEARNING_RATES];
+    unsigned n_learning_rates = split_list(args[4], learning_rate_strings, MAX_LEARNING_RATES);
+    if (n_learning_rates == 0) {
+        request_error(29, "Too many learning rates (max is %u)", MAX_LEARNING_RATES);
+    }
+    for (unsigned i = 0; i < n_learning_rates; ++i) {
+        if (sscanf(learning_rate_strings[i], "%lf", learning_rates + i) < 1) {
+            request_error(7, "Error parsing learning_rate (fifth argument)");
+        }
     }
 
-    for (unsigned i = 0; i < MAX_CARDINALITY; ++i) {
-        size_t sz = ((num_trials / 8) + 1) * sizeof(uint8_t);
-        state.correct_at[i] = malloc(sz);
-        memset(state.correct_at[i], 0, sz);
+    if (sscanf(args[5], "%u", &(config.max_cue)) < 1) {
+        request_error(9, "Error parsing max_cue (sixth argument)");
+    }
+    if (config.max_cue == 0) {
+        request_error(10, "max_cue (sixth argument) must be greater than 0");
+    }
+    if (config.max_cue > MAX_CARDINALITY) {
+        request_error(11, "Value of max_cue (sixth argument) is too big.");
+    }
+
+    if (sscanf(args[6], "%llu", &(config.n_trials)) < 1) {
+        request_error(12, "Error parsing number of trials (seventh argument)");
     }
 
     const char *output_mode_string = args[7];
-    if (! strcmp(output_mode_string, "full")) {
-        state.output_mode = OUTPUT_MODE_FULL;
+    // Parsed once everything else has been checked, since it may allocate.
+    const char *schedule_spec = NULL;
+    if (! strncmp(output_mode_string, "full", 4)) {
+        config.output_mode = NS_OUTPUT_MODE_FULL;
+        schedule_spec = output_mode_string + 4;
     }
     else if (! strcmp(output_mode_string, "summary")) {
-        state.output_mode = OUTPUT_MODE_SUMMARY;
+        config.output_mode = NS_OUTPUT_MODE_SUMMARY;
     }
     else if (! strcmp(output_mode_string, "range_summary")) {
-        state.output_mode = OUTPUT_MODE_RANGE_SUMMARY;
+        config.output_mode = NS_OUTPUT_MODE_RANGE_SUMMARY;
+    }
+    else if (! strncmp(output_mode_string, "aggregate", 9)) {
+        config.output_mode = NS_OUTPUT_MODE_AGGREGATE;
+        parse_stopping_rule(output_mode_string + 9, &stopping_rule);
+    }
+    else if (! strncmp(output_mode_string, "trajectory", 10)) {
+        config.output_mode = NS_OUTPUT_MODE_TRAJECTORY;
+        schedule_spec = output_mode_string + 10;
     }
     else {
-        fprintf(stderr, "Bad value for output_mode (eighth argument, should be \"summary\" or \"full\")");
-        exit(13);
+        request_error(13, "Bad value for output_mode (eighth argument, should be \"summary\", \"range_summary\", \"aggregate\", \"trajectory\" or \"full\")");
     }
 
-    if (sscanf(args[8], "%u", &(state.quit_after_n_correct)) < 1) {
-        fprintf(stderr, "Bad value for quit_after_n_correct (ninth argument)\n");
-        exit(14);
+    if (sscanf(args[8], "%u", &(config.quit_after_n_correct)) < 1) {
+        request_error(14, "Bad value for quit_after_n_correct (ninth argument)");
     }
 
     const unsigned DIST_ARGI = 9;
 
-    if (num_args != DIST_ARGI + state.max_cue - 1) {
-        fprintf(stderr, "Incorrect number of p values for probability distribution (%u given, %u required)\n", num_args-DIST_ARGI, state.max_cue-1);
-        exit(16);
+    if (num_args != DIST_ARGI + config.max_cue - 1) {
+        request_error(16, "Incorrect number of p values for probability distribution (%u given, %u required)", num_args-DIST_ARGI, config.max_cue-1);
     }
-    for (unsigned i = 0; i < 0 + state.max_cue - 1; ++i) {
-        double p;
-        if (sscanf(args[i+DIST_ARGI], "%lf", &p) < 1) {
-            fprintf(stderr, "Error parsing probability value.\n");
-            exit(17);
+    double ps[MAX_CARDINALITY];
+    for (unsigned i = 0; i < 0 + config.max_cue - 1; ++i) {
+        if (sscanf(args[i+DIST_ARGI], "%lf", ps + i) < 1) {
+            request_error(17, "Error parsing probability value.");
+        }
+    }
+    config.distribution = ps;
+
+    // One state for each combination of language and learning rate, with the
+    // learning rate varying fastest.
+    const unsigned n_states = n_languages * n_learning_rates;
+    if (n_states > 1 && (config.output_mode == NS_OUTPUT_MODE_FULL || config.output_mode == NS_OUTPUT_MODE_TRAJECTORY)) {
+        request_error(30, "Output modes 'full' and 'trajectory' can't be used with more than one language or learning rate");
+    }
+    if (schedule_spec)
+        parse_output_schedule(schedule_spec, &output_schedule);
+
+    // Everything allocated from here on is freed before reporting an error,
+    // since the daemon carries on after a bad request.
+    const size_t counts_per_state = config.n_trials * (config.max_cue + 1);
+    ns_state_t **states = malloc(n_states * sizeof(ns_state_t *));
+    uint64_t *aggregate_counts = NULL;
+    // With no trials there are no counts, but calloc(0, ...) may return NULL.
+    if (config.output_mode == NS_OUTPUT_MODE_AGGREGATE)
+        aggregate_counts = calloc(counts_per_state ? n_states * counts_per_state : 1, sizeof(uint64_t));
+    if (! states || (config.output_mode == NS_OUTPUT_MODE_AGGREGATE && ! aggregate_counts)) {
+        free_request(states, 0, aggregate_counts, &output_schedule);
+        request_error(exit_code_for_error(NS_ERROR_OUT_OF_MEMORY), "%s", ns_error_string(NS_ERROR_OUT_OF_MEMORY));
+    }
+    for (unsigned i = 0; i < n_states; ++i) {
+        config.language = language_names[i / n_learning_rates];
+        config.learning_rate = learning_rates[i % n_learning_rates];
+        ns_error_t error = ns_state_new(ctx, &config, states + i);
+        if (error != NS_OK) {
+            free_request(states, i, aggregate_counts, &output_schedule);
+            request_error(exit_code_for_error(error), "%s", ns_context_error(ctx));
+        }
+    }
+
+    trajectory_t trajectory;
+    if (config.output_mode == NS_OUTPUT_MODE_TRAJECTORY && ! init_trajectory(&trajectory, states[0], &output_schedule)) {
+        free_request(states, n_states, aggregate_counts, &output_schedule);
+        request_error(exit_code_for_error(NS_ERROR_OUT_OF_MEMORY), "%s", ns_error_string(NS_ERROR_OUT_OF_MEMORY));
+    }
+
+    // Answer from the cache if possible, and otherwise write the output to
+    // a new cache entry.
+    char *cache_key = NULL;
+    FILE *uncached_output = NULL;
+    // The cache is best effort, so a request is just run if there isn't
+    // enough memory for its key.
+    if (cache)
+        cache_key = make_cache_key(states, n_states, learning_rate_strings, n_learning_rates, &config, first_run, last_run, output_mode_string);
+    if (cache_key) {
+        if (cache_fetch(cache, cache_key, output)) {
+            free(cache_key);
+            if (config.output_mode == NS_OUTPUT_MODE_TRAJECTORY)
+                free_trajectory(&trajectory);
+            free_request(states, n_states, aggregate_counts, &output_schedule);
+            return;
         }
-        state.thresholds[i] = (uint32_t)(UINT32_MAX * p);
-        if (i > 0) {
-            state.thresholds[i] += state.thresholds[i-1];
+        FILE *f = cache_begin(cache, cache_key);
+        if (f) {
+            uncached_output = output;
+            output = f;
         }
     }
 
-    // Find the specified language.
-    language_t *lang = NULL;
-    for (unsigned i = 0; i < 2; ++i) {
-        for (language_t *l = languages; l->name[0] != '\0'; ++l) {
-            if (! strcmp(l->name, language_name)) {
-                lang = l;
+    uint64_t run;
+    for (run = first_run; ; ++run) {
+        for (unsigned i = 0; i < n_states; ++i)
+            ns_start_run(states[i], run);
+
+        if (config.output_mode == NS_OUTPUT_MODE_TRAJECTORY) {
+            start_trajectory_run(&trajectory, states[0]);
+            ns_run(states[0], accumulate_trajectory, &trajectory);
+        }
+        else if (n_states == 1) {
+            run_and_output_trials(states[0], config.output_mode, &output_schedule);
+        }
+        else {
+            ns_error_t error = ns_run_lockstep(ctx, states, n_states);
+            if (error != NS_OK) {
+                if (uncached_output) {
+                    cache_abort(cache, output);
+                    output = uncached_output;
+                }
+                free(cache_key);
+                free_request(states, n_states, aggregate_counts, &output_schedule);
+                request_error(exit_code_for_error(error), "%s", ns_context_error(ctx));
+            }
+            if (config.output_mode != NS_OUTPUT_MODE_AGGREGATE) {
+                for (unsigned i = 0; i < n_states; ++i) {
+                    output_combination_heading(states[i], learning_rate_strings[i % n_learning_rates]);
+                    output_run(states[i], config.output_mode);
+                }
+            }
+        }
+
+        if (aggregate_counts) {
+            for (unsigned i = 0; i < n_states; ++i)
+                ns_add_correct_counts(states[i], aggregate_counts + (i * counts_per_state));
+        }
+
+        // Check whether every combination is precise enough at the end of
+        // each block.
+        uint64_t n_runs = run - first_run + 1;
+        if (stopping_rule.max_band_width > 0 && n_runs % stopping_rule.block_size == 0) {
+            unsigned i;
+            for (i = 0; i < n_states; ++i) {
+                if (max_band_width(states[i], aggregate_counts + (i * counts_per_state), n_runs) > stopping_rule.max_band_width)
+                    break;
+            }
+            if (i == n_states)
                 break;
+        }
+
+        if (run == last_run)
+            break; // Not in the loop condition in case last_run is (2^64)-1.
+    }
+
+    if (aggregate_counts) {
+        for (unsigned i = 0; i < n_states; ++i) {
+            if (n_states > 1)
+                output_combination_heading(states[i], learning_rate_strings[i % n_learning_rates]);
+            output_aggregate(states[i], aggregate_counts + (i * counts_per_state), run - first_run + 1, &stopping_rule);
+        }
+        fflush(output);
+    }
+
+    if (config.output_mode == NS_OUTPUT_MODE_TRAJECTORY) {
+        output_trajectory(states[0], &trajectory);
+        free_trajectory(&trajectory);
+    }
+
+    if (uncached_output) {
+        cache_commit(cache, output, uncached_output);
+        output = uncached_output;
+    }
+    free(cache_key);
+
+    free_request(states, n_states, aggregate_counts, &output_schedule);
+}
+
+// Runs a line of arguments, writing its output to 'out'. Returns 0, or (if
+// the request is bad) the code numbersim would have exited with, with the
+// message in 'error'.
+static int run_request(void *ctx, char *arguments, FILE *out, char *error, size_t error_size)
+{
+    FILE *saved_output = output;
+    jmp_buf jump;
+    if (setjmp(jump) != 0) {
+        request_error_jump = NULL;
+        output = saved_output;
+        snprintf(error, error_size, "%s", request_error_message);
+        return request_error_code;
+    }
+    request_error_jump = &jump;
+    output = out;
+
+    char *args[MAX_ARGS];
+    unsigned num_args = string_to_arg_array(arguments, args);
+    run_given_arguments(ctx, num_args, args);
+    fprintf(output, "\n");
+
+    request_error_jump = NULL;
+    output = saved_output;
+    return 0;
+}
+
+static uint64_t microseconds_since(const struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((uint64_t)(now.tv_sec - start->tv_sec) * 1000000) + (now.tv_nsec / 1000) - (start->tv_nsec / 1000);
+}
+
+static int compare_uint64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+// Nearest-rank percentile of n sorted values.
+static uint64_t percentile(const uint64_t *sorted, size_t n, unsigned p)
+{
+    size_t rank = ((n * p) + 99) / 100;
+    return sorted[rank == 0 ? 0 : rank - 1];
+}
+
+static void replay_trace(ns_context_t *ctx, const char *filename, char *buf)
+{
+    FILE *f = fopen(filename, "r");
+    if (! f) {
+        fprintf(stderr, "Error opening trace file %s\n", filename);
+        exit(32);
+    }
+
+    size_t n_requests = 0, n_failed = 0, latencies_capacity = 1024;
+    uint64_t *latencies = malloc(latencies_capacity * sizeof(uint64_t));
+    uint64_t recorded_us = 0;
+    uint64_t checksum = FNV1A_64_INIT;
+    if (! latencies) {
+        fprintf(stderr, "%s\n", ns_error_string(NS_ERROR_OUT_OF_MEMORY));
+        exit(exit_code_for_error(NS_ERROR_OUT_OF_MEMORY));
+    }
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    size_t sz = ARGS_STRING_MAX_LENGTH * sizeof(char);
+    unsigned line_number = 0;
+    while (getline(&buf, &sz, f) >= 0) {
+        ++line_number;
+        if (buf[0] == '#' || buf[0] == '\n')
+            continue;
+
+        unsigned long long arrival_us, service_us;
+        int args_start;
+        if (sscanf(buf, "%llu %llu %n", &arrival_us, &service_us, &args_start) != 2) {
+            fprintf(stderr, "Error parsing trace file %s, line %u\n", filename, line_number);
+            exit(32);
+        }
+        recorded_us += service_us;
+
+        char *out_buf = NULL;
+        size_t out_size = 0;
+        FILE *out = open_memstream(&out_buf, &out_size);
+        if (! out) {
+            fprintf(stderr, "%s\n", ns_error_string(NS_ERROR_OUT_OF_MEMORY));
+            exit(exit_code_for_error(NS_ERROR_OUT_OF_MEMORY));
+        }
+
+        struct timespec request_start;
+        clock_gettime(CLOCK_MONOTONIC, &request_start);
+        char error[256];
+        int exit_code = run_request(ctx, buf + args_start, out, error, sizeof(error));
+        fclose(out);
+        uint64_t latency = microseconds_since(&request_start);
+
+        // A bad request is reported and left out of the checksum and the
+        // latencies, rather than ending the replay.
+        if (exit_code != 0) {
+            fprintf(stderr, "Request on line %u of %s failed (exit code %i): %s\n", line_number, filename, exit_code, error);
+            ++n_failed;
+            free(out_buf);
+            continue;
+        }
+        checksum = fnv1a_64(checksum, out_buf, out_size);
+        free(out_buf);
+
+        if (n_requests == latencies_capacity) {
+            latencies_capacity *= 2;
+            latencies = realloc(latencies, latencies_capacity * sizeof(uint64_t));
+            if (! latencies) {
+                fprintf(stderr, "%s\n", ns_error_string(NS_ERROR_OUT_OF_MEMORY));
+                exit(exit_code_for_error(NS_ERROR_OUT_OF_MEMORY));
             }
         }
-        if (lang)
+        latencies[n_requests++] = latency;
+    }
+    if (ferror(f)) {
+        fprintf(stderr, "Error reading trace file %s\n", filename);
+        exit(32);
+    }
+    fclose(f);
+
+    uint64_t total_us = microseconds_since(&start);
+    qsort(latencies, n_requests, sizeof(uint64_t), compare_uint64);
+
+    printf("requests,%zu\n", n_requests + n_failed);
+    printf("failed,%zu\n", n_failed);
+    printf("total_seconds,%f\n", total_us / 1e6);
+    printf("recorded_service_seconds,%f\n", recorded_us / 1e6);
+    printf("requests_per_second,%f\n", total_us ? (n_requests + n_failed) / (total_us / 1e6) : 0.0);
+    if (n_requests > 0) {
+        static const unsigned percentiles[] = { 50, 90, 99, 100 };
+        for (unsigned i = 0; i < sizeof(percentiles)/sizeof(percentiles[0]); ++i)
+            printf("latency_us_p%u,%llu\n", percentiles[i], percentile(latencies, n_requests, percentiles[i]));
+    }
+    printf("checksum,%016llx\n", checksum);
+
+    free(latencies);
+    if (n_failed > 0)
+        exit(32);
+}
+
+typedef enum distribution_family {
+    DISTRIBUTION_ZTNBD,
+    DISTRIBUTION_UNIFORM,
+    DISTRIBUTION_RANDOM
+} distribution_family_t;
+
+typedef struct sweep_cell {
+    ns_config_t config;
+    const char *learning_rate_string;
+    const char *distribution_name;
+    distribution_family_t family;
+    double distribution[MAX_CARDINALITY];
+    // Number of runs which got each cardinality (and then all cardinalities)
+    // right at each trial, as for ns_add_correct_counts().
+    uint64_t *counts;
+} sweep_cell_t;
+
+typedef struct sweep {
+    sweep_cell_t *cells;
+    unsigned n_cells;
+    uint64_t first_run, last_run;
+    uint64_t blocks_per_cell;
+    // Guards next_block and the counts of every cell.
+    pthread_mutex_t mutex;
+    uint64_t next_block;
+} sweep_t;
+
+static double ztnbd(unsigned k, double beta, double r)
+{
+    double top = r;
+    for (unsigned i = 1; i < k; ++i)
+        top *= r + i;
+    double factorial = 1;
+    for (unsigned i = 2; i <= k; ++i)
+        factorial *= i;
+    top /= factorial * (pow(1.0 + beta, r) - 1);
+    return top * pow(beta / (1.0 + beta), k);
+}
+
+// Sets cell->family and, unless it's 'random', cell->distribution.
+static void parse_distribution_family(const char *spec, sweep_cell_t *cell)
+{
+    unsigned max_cue = cell->config.max_cue;
+    double beta = 0.6, r = 3;
+    char junk;
+    if (! strcmp(spec, "ztnbd") || sscanf(spec, "ztnbd:%lf:%lf%c", &beta, &r, &junk) == 2) {
+        cell->family = DISTRIBUTION_ZTNBD;
+        for (unsigned i = 0; i < max_cue - 1; ++i)
+            cell->distribution[i] = ztnbd(i + 1, beta, r);
+    }
+    else if (! strcmp(spec, "uniform")) {
+        cell->family = DISTRIBUTION_UNIFORM;
+        for (unsigned i = 0; i < max_cue - 1; ++i)
+            cell->distribution[i] = 1.0 / max_cue;
+    }
+    else if (! strcmp(spec, "random")) {
+        cell->family = DISTRIBUTION_RANDOM;
+        for (unsigned i = 0; i < max_cue - 1; ++i)
+            cell->distribution[i] = 1.0 / max_cue; // Replaced for each run.
+    }
+    else {
+        fprintf(stderr, "Bad distribution family '%s' (should be \"ztnbd\", \"ztnbd:BETA:R\", \"uniform\" or \"random\")\n", spec);
+        exit(34);
+    }
+}
+
+static void random_distribution(const ns_config_t *config, uint64_t run, double *ps)
+{
+    pcg32_random_t rng;
+    pcg32_srandom_r(&rng, config->seed2, config->seed1 | 1);
+    pcg32_advance_r(&rng, run * RUN_STREAM_STRIDE);
+
+    double total = ldexp(pcg32_random_r(&rng), -32);
+    for (unsigned i = 0; i < config->max_cue - 1; ++i) {
+        ps[i] = ldexp(pcg32_random_r(&rng), -32);
+        total += ps[i];
+    }
+    for (unsigned i = 0; i < config->max_cue - 1; ++i)
+        ps[i] /= total;
+}
+
+static void *sweep_worker(void *data)
+{
+    sweep_t *sweep = data;
+
+    // Contexts can't be shared between threads, so each worker loads the
+    // language file into its own.
+    ns_context_t *ctx = ns_context_new();
+    if (! ctx) {
+        fprintf(stderr, "%s\n", ns_error_string(NS_ERROR_OUT_OF_MEMORY));
+        exit(exit_code_for_error(NS_ERROR_OUT_OF_MEMORY));
+    }
+
+    for (;;) {
+        pthread_mutex_lock(&(sweep->mutex));
+        uint64_t block = sweep->next_block++;
+        pthread_mutex_unlock(&(sweep->mutex));
+        if (block >= sweep->n_cells * sweep->blocks_per_cell)
             break;
-        else
-            get_languages(language_file_name, languages);
+
+        sweep_cell_t *cell = sweep->cells + (block / sweep->blocks_per_cell);
+        uint64_t first_run = sweep->first_run + ((block % sweep->blocks_per_cell) * ENSEMBLE_BLOCK_SIZE);
+        uint64_t last_run = first_run + ENSEMBLE_BLOCK_SIZE - 1;
+        if (last_run > sweep->last_run || last_run < first_run)
+            last_run = sweep->last_run;
+
+        ns_state_t *state = NULL;
+        size_t n_counts = (cell->config.max_cue + 1) * cell->config.n_trials;
+        uint64_t *counts = calloc(n_counts ? n_counts : 1, sizeof(uint64_t));
+        ns_error_t error = counts ? ns_state_new(ctx, &(cell->config), &state) : NS_ERROR_OUT_OF_MEMORY;
+        if (error != NS_OK) {
+            fprintf(stderr, "%s\n", counts ? ns_context_error(ctx) : ns_error_string(error));
+            exit(exit_code_for_error(error));
+        }
+
+        for (uint64_t run = first_run; ; ++run) {
+            ns_start_run(state, run);
+            if (cell->family == DISTRIBUTION_RANDOM) {
+                double ps[MAX_CARDINALITY];
+                random_distribution(&(cell->config), run, ps);
+                ns_set_distribution(state, ps);
+            }
+            ns_run(state, NULL, NULL);
+            ns_add_correct_counts(state, counts);
+            if (run == last_run)
+                break;
+        }
+
+        pthread_mutex_lock(&(sweep->mutex));
+        for (size_t i = 0; i < n_counts; ++i)
+            cell->counts[i] += counts[i];
+        pthread_mutex_unlock(&(sweep->mutex));
+
+        free(counts);
+        ns_state_free(state);
+    }
+
+    ns_context_free(ctx);
+    return NULL;
+}
+
+static void output_sweep(const sweep_t *sweep)
+{
+    uint64_t n_runs = sweep->last_run - sweep->first_run + 1;
+    fprintf(output, "language,distribution,learning_rate,max_cue,trial,cardinality,runs,correct,fraction\n");
+    for (unsigned c = 0; c < sweep->n_cells; ++c) {
+        const sweep_cell_t *cell = sweep->cells + c;
+        for (uint64_t t = 0; t < cell->config.n_trials; ++t) {
+            for (unsigned i = 0; i <= cell->config.max_cue; ++i) {
+                uint64_t correct = cell->counts[(i * cell->config.n_trials) + t];
+                // Language names can contain commas.
+                fprintf(output, "\"%s\",%s,%s,%u,%llu,", cell->config.language, cell->distribution_name, cell->learning_rate_string, cell->config.max_cue, t);
+                if (i < cell->config.max_cue)
+                    fprintf(output, "%u", i + 1);
+                else
+                    fprintf(output, "all");
+                fprintf(output, ",%llu,%llu,%f\n", n_runs, correct, (double)correct / n_runs);
+            }
+        }
+    }
+    fflush(output);
+}
+
+static void run_sweep(ns_context_t *ctx, int num_args, char **args)
+{
+    if (num_args != 8 && num_args != 9) {
+        fprintf(stderr, "Wrong number of arguments for --sweep (8 or 9 required)\n");
+        exit(2);
+    }
+
+    ns_config_t config;
+    memset(&config, 0, sizeof(config));
+    config.language_file = args[0];
+    config.output_mode = NS_OUTPUT_MODE_AGGREGATE;
+
+    sweep_t sweep;
+    sweep.first_run = sweep.last_run = 0;
+    int n_seed_parts = sscanf(args[1], "%llu:%llu-%llu", &(config.seed1), &(sweep.first_run), &(sweep.last_run));
+    if (n_seed_parts < 1) {
+        fprintf(stderr, "Error parsing first random seed '%s' (second argument)\n", args[1]);
+        exit(3);
+    }
+    config.partitioned = n_seed_parts > 1;
+    if (n_seed_parts == 2)
+        sweep.last_run = sweep.first_run;
+    if (sweep.last_run < sweep.first_run) {
+        fprintf(stderr, "Bad range of runs '%s' (second argument)\n", args[1]);
+        exit(24);
+    }
+    if (sweep.last_run > MAX_PARTITIONED_RUN) {
+        fprintf(stderr, "Run index in '%s' is too big (max is %llu)\n", args[1], MAX_PARTITIONED_RUN);
+        exit(24);
+    }
+    if (sscanf(args[2], "%llu", &(config.seed2)) < 1) {
+        fprintf(stderr, "Error parsing second random seed '%s' (third argument)\n", args[2]);
+        exit(4);
+    }
+
+    char *language_names[MAX_LANGUAGES];
+    unsigned n_languages;
+    if (! strcmp(args[3], "*")) {
+        ns_error_t error = ns_load_languages(ctx, config.language_file);
+        if (error != NS_OK) {
+            fprintf(stderr, "%s\n", ns_context_error(ctx));
+            exit(exit_code_for_error(error));
+        }
+        n_languages = ns_language_count(ctx);
+        for (unsigned i = 0; i < n_languages; ++i)
+            language_names[i] = (char *)ns_language_name(ctx, i);
+    }
+    else {
+        n_languages = split_list(args[3], language_names, MAX_LANGUAGES);
     }
-    if (! lang) {
-        fprintf(stderr, "Could not find language %s\n", language_name);
-        exit(19);
+    char *learning_rate_strings[MAX_LEARNING_RATES];
+    unsigned n_learning_rates = split_list(args[4], learning_rate_strings, MAX_LEARNING_RATES);
+    char *max_cue_strings[MAX_CARDINALITY];
+    unsigned n_max_cues = split_list(args[5], max_cue_strings, MAX_CARDINALITY);
+    char *distribution_names[MAX_SWEEP_DISTRIBUTIONS];
+    unsigned n_distributions = split_list(args[7], distribution_names, MAX_SWEEP_DISTRIBUTIONS);
+    if (n_languages == 0 || n_learning_rates == 0 || n_max_cues == 0 || n_distributions == 0) {
+        fprintf(stderr, "Too many languages, learning rates, max_cues or distributions\n");
+        exit(29);
+    }
+
+    if (sscanf(args[6], "%llu", &(config.n_trials)) < 1) {
+        fprintf(stderr, "Error parsing number of trials (seventh argument)\n");
+        exit(12);
+    }
+
+    long n_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (num_args == 9 && (sscanf(args[8], "%ld", &n_threads) < 1 || n_threads <= 0)) {
+        fprintf(stderr, "Bad number of threads '%s'\n", args[8]);
+        exit(35);
+    }
+    if (n_threads <= 0)
+        n_threads = 1;
+
+    // Set up every cell, in the order they're output, checking that each
+    // can be run before starting any of them.
+    sweep.n_cells = n_languages * n_distributions * n_learning_rates * n_max_cues;
+    sweep.cells = calloc(sweep.n_cells, sizeof(sweep_cell_t));
+    if (! sweep.cells) {
+        fprintf(stderr, "%s\n", ns_error_string(NS_ERROR_OUT_OF_MEMORY));
+        exit(exit_code_for_error(NS_ERROR_OUT_OF_MEMORY));
     }
-    memcpy(&state.language, lang, sizeof(language_t));
+    sweep_cell_t *cell = sweep.cells;
+    for (unsigned l = 0; l < n_languages; ++l) {
+        for (unsigned d = 0; d < n_distributions; ++d) {
+            for (unsigned r = 0; r < n_learning_rates; ++r) {
+                for (unsigned m = 0; m < n_max_cues; ++m, ++cell) {
+                    cell->config = config;
+                    cell->config.language = language_names[l];
+                    cell->learning_rate_string = learning_rate_strings[r];
+                    if (sscanf(learning_rate_strings[r], "%lf", &(cell->config.learning_rate)) < 1) {
+                        fprintf(stderr, "Error parsing learning_rate '%s'\n", learning_rate_strings[r]);
+                        exit(7);
+                    }
+                    if (sscanf(max_cue_strings[m], "%u", &(cell->config.max_cue)) < 1) {
+                        fprintf(stderr, "Error parsing max_cue '%s'\n", max_cue_strings[m]);
+                        exit(9);
+                    }
+                    if (cell->config.max_cue == 0 || cell->config.max_cue > MAX_CARDINALITY) {
+                        fprintf(stderr, "Bad value for max_cue '%s'\n", max_cue_strings[m]);
+                        exit(11);
+                    }
+                    cell->distribution_name = distribution_names[d];
+                    parse_distribution_family(distribution_names[d], cell);
+                    cell->config.distribution = cell->distribution;
 
-    double *as = (double *)(state.assocs);
-    for (unsigned i = 0; i < sizeof(state.assocs)/sizeof(state.assocs[0][0]); ++i)
-        as[i] = 0.0;
-    double *cas = (double *)state.compound_cue_assocs;
-    for (unsigned i = 0; i < sizeof(state.compound_cue_assocs)/sizeof(state.compound_cue_assocs[0][0]); ++i)
-        cas[i] = 0.0;
-    memset(state.marker_has_been_correct_for_last, 0, sizeof(state.marker_has_been_correct_for_last));
-    state.all_markers_have_been_correct_for_last = 0;
+                    ns_state_t *state;
+                    ns_error_t error = ns_state_new(ctx, &(cell->config), &state);
+                    if (error != NS_OK) {
+                        fprintf(stderr, "%s\n", ns_context_error(ctx));
+                        exit(exit_code_for_error(error));
+                    }
+                    ns_state_free(state);
 
-    run_trials(&state, num_trials);
+                    cell->counts = calloc(config.n_trials ? (cell->config.max_cue + 1) * config.n_trials : 1, sizeof(uint64_t));
+                    if (! cell->counts) {
+                        fprintf(stderr, "%s\n", ns_error_string(NS_ERROR_OUT_OF_MEMORY));
+                        exit(exit_code_for_error(NS_ERROR_OUT_OF_MEMORY));
+                    }
+                }
+            }
+        }
+    }
+
+    sweep.blocks_per_cell = ((sweep.last_run - sweep.first_run) / ENSEMBLE_BLOCK_SIZE) + 1;
+    sweep.next_block = 0;
+    pthread_mutex_init(&(sweep.mutex), NULL);
+
+    pthread_t *threads = malloc(n_threads * sizeof(pthread_t));
+    if (! threads) {
+        fprintf(stderr, "%s\n", ns_error_string(NS_ERROR_OUT_OF_MEMORY));
+        exit(exit_code_for_error(NS_ERROR_OUT_OF_MEMORY));
+    }
+    for (long i = 0; i < n_threads; ++i) {
+        if (pthread_create(threads + i, NULL, sweep_worker, &sweep) != 0) {
+            fprintf(stderr, "Error creating thread\n");
+            exit(35);
+        }
+    }
+    for (long i = 0; i < n_threads; ++i)
+        pthread_join(threads[i], NULL);
+
+    output_sweep(&sweep);
+
+    pthread_mutex_destroy(&(sweep.mutex));
+    free(threads);
+    for (unsigned i = 0; i < sweep.n_cells; ++i)
+        free(sweep.cells[i].counts);
+    free(sweep.cells);
+}
+
+static void *start_daemon_worker(void)
+{
+    // Each worker has its own context, so languages stay loaded between
+    // requests.
+    ns_context_t *ctx = ns_context_new();
+    if (! ctx) {
+        fprintf(stderr, "%s\n", ns_error_string(NS_ERROR_OUT_OF_MEMORY));
+        exit(exit_code_for_error(NS_ERROR_OUT_OF_MEMORY));
+    }
+    return ctx;
+}
+
+static void end_daemon_worker(void *ctx)
+{
+    ns_context_free(ctx);
+}
+
+static void run_numbersim_daemon(unsigned num_args, char *args[])
+{
+    long n_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (num_args == 2 && (sscanf(args[1], "%ld", &n_threads) < 1 || n_threads <= 0)) {
+        fprintf(stderr, "Bad number of threads '%s'\n", args[1]);
+        exit(35);
+    }
+    if (n_threads <= 0)
+        n_threads = 1;
+
+    static const daemon_handler_t handler = {
+        .start_worker = start_daemon_worker,
+        .end_worker = end_daemon_worker,
+        .run = run_request
+    };
+    char error[256];
+    if (! run_daemon(args[0], n_threads, &handler, error, sizeof(error))) {
+        fprintf(stderr, "%s\n", error);
+        exit(36);
+    }
 }
 
 int main(int argc, char *argv[])
 {
-    // No need to free this as it is used until process exits.
+    // No need to free these as they are used until process exits.
     char *buf = malloc(ARGS_STRING_MAX_LENGTH * sizeof(char));
+    ns_context_t *ctx = ns_context_new();
+    if (! buf || ! ctx) {
+        fprintf(stderr, "%s\n", ns_error_string(NS_ERROR_OUT_OF_MEMORY));
+        exit(exit_code_for_error(NS_ERROR_OUT_OF_MEMORY));
+    }
 
-    if (argc > 1) {
-        run_given_arguments(argc - 1, argv + 1);
-        printf("\n");
-        fflush(stdout);
+    output = stdout;
+
+    // The cache can only be used by one thread at a time, so the daemon
+    // doesn't use it. Nor does a replay, which should time the simulations
+    // rather than cache hits.
+    bool daemon_mode = (argc == 3 || argc == 4) && ! strcmp(argv[1], "--daemon");
+    bool replay_mode = argc == 3 && ! strcmp(argv[1], "--replay");
+
+    const char *cache_directory = getenv("NUMBERSIM_CACHE");
+    if (cache_directory && cache_directory[0] && ! daemon_mode && ! replay_mode) {
+        uint64_t max_mb = CACHE_DEFAULT_MAX_MB;
+        const char *max_mb_string = getenv("NUMBERSIM_CACHE_MB");
+        if (max_mb_string && sscanf(max_mb_string, "%llu", &max_mb) < 1) {
+            fprintf(stderr, "Bad value for NUMBERSIM_CACHE_MB\n");
+            exit(33);
+        }
+        cache = cache_open(cache_directory, max_mb * 1024 * 1024);
+        if (! cache) {
+            fprintf(stderr, "Error opening cache directory %s\n", cache_directory);
+            exit(33);
+        }
+    }
+
+    if (daemon_mode) {
+        run_numbersim_daemon(argc - 2, argv + 2);
+    }
+    else if (replay_mode) {
+        replay_trace(ctx, argv[2], buf);
+    }
+    else if (argc > 1 && ! strcmp(argv[1], "--sweep")) {
+        run_sweep(ctx, argc - 2, argv + 2);
+    }
+    else if (argc > 1) {
+        run_given_arguments(ctx, argc - 1, argv + 1);
+        fprintf(output, "\n");
+        fflush(output);
     }
     else {
+        FILE *trace = NULL;
+        const char *trace_filename = getenv("NUMBERSIM_RECORD");
+        if (trace_filename && trace_filename[0]) {
+            trace = fopen(trace_filename, "w");
+            if (! trace) {
+                fprintf(stderr, "Error opening trace file %s\n", trace_filename);
+                exit(32);
+            }
+            fprintf(trace, "# numbersim trace: ARRIVAL_US SERVICE_US ARGUMENTS\n");
+        }
+        // The arguments are split in place, so the line has to be copied before
+        // it's run in order to record it.
+        char *trace_line = trace ? malloc(ARGS_STRING_MAX_LENGTH * sizeof(char)) : NULL;
+        if (trace && ! trace_line) {
+            fprintf(stderr, "%s\n", ns_error_string(NS_ERROR_OUT_OF_MEMORY));
+            exit(exit_code_for_error(NS_ERROR_OUT_OF_MEMORY));
+        }
+
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
         for (;;) {
             size_t sz = ARGS_STRING_MAX_LENGTH * sizeof(char);
             int bytes_read = getline(&buf, &sz, stdin);
@@ -489,11 +1616,23 @@ int main(int argc, char *argv[])
                 }
             }
             else if (bytes_read > 0) {
+                uint64_t arrival_us = microseconds_since(&start);
+                if (trace) {
+                    strncpy(trace_line, buf, ARGS_STRING_MAX_LENGTH - 1);
+                    trace_line[ARGS_STRING_MAX_LENGTH - 1] = '\0';
+                    trace_line[strcspn(trace_line, "\n")] = '\0';
+                }
+
                 static char *args[MAX_ARGS];
                 unsigned num_args = string_to_arg_array(buf, args);
-                run_given_arguments(num_args, args);
-                printf("\n");
-                fflush(stdout);
+                run_given_arguments(ctx, num_args, args);
+                fprintf(output, "\n");
+                fflush(output);
+
+                if (trace) {
+                    fprintf(trace, "%llu %llu %s\n", arrival_us, microseconds_since(&start) - arrival_us, trace_line);
+                    fflush(trace);
+                }
             }
         }
     }
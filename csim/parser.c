@@ -7,12 +7,13 @@
 #include <string.h>
 #include <assert.h>
 
-void get_languages(const char *filename, language_t *languages)
+bool get_languages(const char *filename, language_t *languages, char *error, size_t error_size)
 {
     FILE *f = fopen(filename, "r");
     if (! f) {
-        fprintf(stderr, "Error opening %s\n", filename);
-        exit(1);
+        snprintf(error, error_size, "Error opening %s", filename);
+        languages[0].name[0] = '\0';
+        return false;
     }
 
     unsigned current_languages_index = 0;
@@ -32,13 +33,13 @@ void get_languages(const char *filename, language_t *languages)
     unsigned col = 1;
     for (;;) {
         if (current_languages_index >= MAX_LANGUAGES) {
-            fprintf(stderr, "Too many languages\n");
+            snprintf(error, error_size, "Too many languages");
             goto err;
         }
 
         int ci = fgetc(f);
         if (ci != EOF && ci < 0) {
-            fprintf(stderr, "Error reading %s\n", filename);
+            snprintf(error, error_size, "Error reading %s", filename);
             goto err;
         }
         char c = (char)ci;
@@ -56,7 +57,7 @@ void get_languages(const char *filename, language_t *languages)
 
         if (state == 'r') {
             if (current_language->default_marker_index == -1) {
-                fprintf(stderr, "[0] No default marker set for language %s\n", current_language->name);
+                snprintf(error, error_size, "[0] No default marker set for language %s", current_language->name);
                 goto err;
             }
             for (unsigned i = 0; i < MAX_CARDINALITY; ++i) {
@@ -85,7 +86,7 @@ void get_languages(const char *filename, language_t *languages)
         }
         else if (state == 'i') {
             if (current_name_index + 1 >= LANGUAGE_NAME_MAX_LENGTH) {
-                fprintf(stderr, "[1] Language name too long in %s\n, line %i col %i", filename, line, col);
+                snprintf(error, error_size, "[1] Language name too long in %s, line %i col %i", filename, line, col);
                 goto err;
             }
             current_language->name[current_name_index++] = c;
@@ -101,12 +102,12 @@ void get_languages(const char *filename, language_t *languages)
             state = 'm';
         }
         else if (state == 's') {
-            fprintf(stderr, "[2] Unexpected character '%c' in %s, line %i col %i\n", c, filename, line, col);
+            snprintf(error, error_size, "[2] Unexpected character '%c' in %s, line %i col %i", c, filename, line, col);
             goto err;
         }
         else if (state == 'm' && isalpha(c)) {
             if (current_marker_index + 1 >= MARKER_MAX_LENGTH) {
-                fprintf(stderr, "[3] Marker name too long in %s, line %i col %i\n", filename, line, col);
+                snprintf(error, error_size, "[3] Marker name too long in %s, line %i col %i", filename, line, col);
                 goto err;
             }
             current_marker[current_marker_index++] = c;
@@ -119,7 +120,7 @@ void get_languages(const char *filename, language_t *languages)
             state = 't';
         }
         else if (state == 'm') {
-            fprintf(stderr, "[4] Unexpected character in %s, line %i col %i\n", filename, line, col);
+            snprintf(error, error_size, "[4] Unexpected character in %s, line %i col %i", filename, line, col);
             goto err;
         }
         else if (state == 't' && isspace(c)) {
@@ -138,12 +139,12 @@ void get_languages(const char *filename, language_t *languages)
             state = 's';
         }
         else if (state == 't') {
-            fprintf(stderr, "[5] Unexpected character '%c' in %s, line %i col %i\n", c, filename, line, col);
+            snprintf(error, error_size, "[5] Unexpected character '%c' in %s, line %i col %i", c, filename, line, col);
             goto err;
         }
         else if (state == 'n' && isdigit(c)) {
             if (current_num_index + 1 > sizeof(current_num)/sizeof(char)) {
-                fprintf(stderr, "[6] Cardinality too big in %s, line %i col %i\n", filename, line, col);
+                snprintf(error, error_size, "[6] Cardinality too big in %s, line %i col %i", filename, line, col);
                 goto err;
             }
             current_num[current_num_index++] = c;
@@ -151,6 +152,10 @@ void get_languages(const char *filename, language_t *languages)
         else if (state == 'n' && (isspace(c) || c == '\n')) {
             current_num[current_num_index] = '\0';
             int n = atoi(current_num) - 1;
+            if (n < 0 || n >= MAX_CARDINALITY) {
+                snprintf(error, error_size, "[7] Cardinality out of range in %s, line %i col %i", filename, line, col);
+                goto err;
+            }
             current_language->n_to_marker[n] = markers_index-1;
             current_num_index = 0;
             if (c == '\n')
@@ -161,14 +166,14 @@ void get_languages(const char *filename, language_t *languages)
     }
 
     if (state != 's' && state != 'r' && state != 't' && (! (state == 'i' && line == 1 && col == 0))) {
-        fprintf(stderr, "[8] Unexpected end of file (%c)\n", state);
+        snprintf(error, error_size, "[8] Unexpected end of file (%c)", state);
         goto err;
     }
 
     if (current_languages_index > 0) {
         current_language->num_markers = markers_index;
         if (current_language->default_marker_index == -1) {
-            fprintf(stderr, "[9] No default marker set for language %s\n", current_language->name);
+            snprintf(error, error_size, "[9] No default marker set for language %s", current_language->name);
             goto err;
         }
         for (unsigned i = 0; i < MAX_CARDINALITY; ++i) {
@@ -180,11 +185,29 @@ void get_languages(const char *filename, language_t *languages)
     languages[current_languages_index+1].name[0] = '\0';
 
     fclose(f);
-    return;
+    return true;
 
 err:
     fclose(f);
-    exit(1);
+    // Don't leave a partially parsed table behind.
+    languages[0].name[0] = '\0';
+    return false;
+}
+
+bool find_language(language_t *languages, const char *filename, const char *name, const language_t **language, char *error, size_t error_size)
+{
+    *language = NULL;
+    for (unsigned i = 0; i < 2; ++i) {
+        for (language_t *l = languages; l->name[0] != '\0'; ++l) {
+            if (! strcmp(l->name, name)) {
+                *language = l;
+                return true;
+            }
+        }
+        if (i == 0 && ! get_languages(filename, languages, error, error_size))
+            return false;
+    }
+    return true;
 }
 
 void test_print_languages(language_t *languages)
@@ -1,6 +1,8 @@
 #ifndef PARSER_H
 #define PARSER_H
 
+#include <stddef.h>
+#include <stdbool.h>
 #include <config.h>
 
 typedef struct language {
@@ -12,7 +14,13 @@ typedef struct language {
     unsigned default_marker_index;
 } language_t;
 
-void get_languages(const char *filename, language_t *languages);
+// Both of the following return false and write a message to 'error' if the
+// language file can't be read or parsed.
+bool get_languages(const char *filename, language_t *languages, char *error, size_t error_size);
+// Looks up a language by name, (re)loading the languages in 'filename' if
+// it is not already in 'languages'. Sets *language to NULL if there is no
+// such language.
+bool find_language(language_t *languages, const char *filename, const char *name, const language_t **language, char *error, size_t error_size);
 void test_print_languages(language_t *languages);
 
 #endif
@@ -114,3 +114,38 @@ uint32_t pcg32_boundedrand(uint32_t bound)
     return pcg32_boundedrand_r(&pcg32_global, bound);
 }
 
+
+
+// pcg32_advance(delta)
+// pcg32_advance_r(rng, delta):
+//     Jump the rng ahead by delta steps, as if pcg32_random had been
+//     called delta times.
+
+void pcg32_advance_r(pcg32_random_t* rng, uint64_t delta)
+{
+    // Multi-step advance functions (jump-ahead, jump-back) are computed
+    // in O(log(delta)) time using the method from Forrest B. Brown,
+    // "Random Number Generation with Arbitrary Stride", Transactions of
+    // the American Nuclear Society (Nov. 1994).  Since the generator is
+    // an LCG modulo 2^64, delta wraps around, so jumping back is just
+    // jumping ahead by 2^64 - delta.
+    uint64_t cur_mult = 6364136223846793005ULL;
+    uint64_t cur_plus = rng->inc;
+    uint64_t acc_mult = 1u;
+    uint64_t acc_plus = 0u;
+    while (delta > 0) {
+        if (delta & 1) {
+            acc_mult *= cur_mult;
+            acc_plus = acc_plus * cur_mult + cur_plus;
+        }
+        cur_plus = (cur_mult + 1) * cur_plus;
+        cur_mult *= cur_mult;
+        delta /= 2;
+    }
+    rng->state = acc_mult * rng->state + acc_plus;
+}
+
+void pcg32_advance(uint64_t delta)
+{
+    pcg32_advance_r(&pcg32_global, delta);
+}
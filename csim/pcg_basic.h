@@ -71,6 +71,14 @@ uint32_t pcg32_random_r(pcg32_random_t* rng);
 uint32_t pcg32_boundedrand(uint32_t bound);
 uint32_t pcg32_boundedrand_r(pcg32_random_t* rng, uint32_t bound);
 
+// pcg32_advance(delta)
+// pcg32_advance_r(rng, delta):
+//     Jump the rng ahead by delta steps, as if pcg32_random had been
+//     called delta times, in O(log(delta)) time.
+
+void pcg32_advance(uint64_t delta);
+void pcg32_advance_r(pcg32_random_t* rng, uint64_t delta);
+
 #if __cplusplus
 }
 #endif
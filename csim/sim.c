@@ -0,0 +1,263 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <assert.h>
+#include <sim.h>
+
+// Relative allowance for rounding error in the bounds used by update_state().
+// Much larger than needed, but still far too small to make a difference to
+// how often the winning markers are recomputed.
+#define BOUND_SLACK 1e-12
+
+// Returns the change in the associations of the marker.
+static double update_state_for_marker(state_t *state, unsigned marker_index, uint_fast32_t cardinality, double l)
+{
+    double vax = 0;
+    for (unsigned i = 0; i <= cardinality; ++i) {
+        vax += state->assocs[i][marker_index];
+    }
+
+    double delta_v = state->learning_rate * (l - vax);
+
+    for (unsigned i = 0; i <= cardinality; ++i) {
+        //printf("ADDING card=%i, marker=%i, raw_index=%u, +%f [%f]\n", i, marker_index, (i * state->language.num_markers) + marker_index, delta_v, l);
+        double a = fabs(state->assocs[i][marker_index] += delta_v);
+        if (a > state->assoc_magnitude[i])
+            state->assoc_magnitude[i] = a;
+    }
+
+    return delta_v;
+}
+
+// Compound cue association of a marker for the given cardinality index.
+static double compound_cue_assoc(const state_t *state, unsigned cardinality_index, unsigned marker_index)
+{
+    double sum = 0.0;
+    for (unsigned k = 0; k <= cardinality_index; ++k)
+        sum += state->assocs[k][marker_index];
+    return sum;
+}
+
+void get_compound_cue_assocs(const state_t *state, double out[MAX_CARDINALITY][MAX_MARKERS])
+{
+    for (unsigned i = 0; i < state->max_cue; ++i) {
+        for (unsigned j = 0; j < state->language.num_markers; ++j)
+            out[i][j] = compound_cue_assoc(state, i, j);
+    }
+}
+
+void compute_compound_cue_assocs(state_t *state)
+{
+    get_compound_cue_assocs(state, state->compound_cue_assocs);
+}
+
+// Finds the marker which would be produced for the given cardinality index:
+// the first marker with the greatest positive compound cue association, or -1
+// if no marker has a positive association. Also finds the smallest gap between
+// the winner's association and that of any other marker (or 0, the threshold
+// for producing a marker), since the winner can't change until that gap has
+// closed.
+static void find_winning_marker(state_t *state, unsigned cardinality_index)
+{
+    double sums[MAX_MARKERS];
+    double max_sum = 0.0;
+    int winner = -1;
+    for (unsigned j = 0; j < state->language.num_markers; ++j) {
+        sums[j] = compound_cue_assoc(state, cardinality_index, j);
+        if (sums[j] > max_sum) {
+            max_sum = sums[j];
+            winner = j;
+        }
+    }
+
+    // Any NaN gap makes the margin NaN, so that the winner is always recomputed.
+    double margin = winner == -1 ? INFINITY : max_sum;
+    for (unsigned j = 0; j < state->language.num_markers; ++j) {
+        if ((int)j == winner)
+            continue;
+        double gap = max_sum - sums[j];
+        if (! (gap >= margin))
+            margin = gap;
+    }
+
+    state->winning_marker[cardinality_index] = winner;
+    state->winning_margin[cardinality_index] = margin;
+}
+
+static bool update_state(state_t *state, unsigned marker_index, uint_fast32_t cardinality)
+{
+    double max_delta = 0.0;
+    for (unsigned i = 0; i < state->language.num_markers; ++i) {
+        double delta = fabs(update_state_for_marker(state, i, cardinality, i == marker_index ? 1.0 : 0.0));
+        if (! (delta <= max_delta))
+            max_delta = delta;
+    }
+
+    unsigned correct_for = 0;
+    double magnitude = 0.0;
+    for (unsigned i = 0; i < state->max_cue; ++i) {
+        // Associations 0 to min(i, cardinality) of each marker all changed by
+        // the same delta, so no compound cue association for this cardinality
+        // changed by more than that many times max_delta (plus rounding error),
+        // and no gap between two of them by more than twice as much. Only if
+        // that could have closed the margin is the winner recomputed.
+        magnitude += state->assoc_magnitude[i];
+        unsigned n_changed = (i < cardinality ? i : cardinality) + 1;
+        double bound = (2 * n_changed * max_delta) + ((i + 1) * magnitude * BOUND_SLACK);
+        state->winning_margin[i] -= bound * (1 + BOUND_SLACK);
+        if (! (state->winning_margin[i] > 0))
+            find_winning_marker(state, i);
+
+        if (state->winning_marker[i] == state->language.n_to_marker[i]) {
+            ++correct_for;
+            ++(state->marker_has_been_correct_for_last[i]);
+            state->correct_at[i][state->n_trials / 8] |= (1 << (state->n_trials % 8));
+        }
+        else {
+            state->marker_has_been_correct_for_last[i] = 0;
+        }
+    }
+
+    if (correct_for == state->max_cue) {
+        ++(state->all_markers_have_been_correct_for_last);
+    }
+    else {
+        state->all_markers_have_been_correct_for_last = 0;
+    }
+
+    if (state->output_mode == NS_OUTPUT_MODE_SUMMARY) {
+        // Check if we should quit now.
+        return (state->quit_after_n_correct == 0 ||
+                (state->all_markers_have_been_correct_for_last < state->quit_after_n_correct));
+    }
+    else {
+        return true; // Continue running.
+    }
+}
+
+void set_distribution(state_t *state, const double *ps)
+{
+    for (unsigned i = 0; i < 0 + state->max_cue - 1; ++i) {
+        state->thresholds[i] = (uint32_t)(UINT32_MAX * ps[i]);
+        if (i > 0) {
+            state->thresholds[i] += state->thresholds[i-1];
+        }
+    }
+}
+
+void free_correct_at(state_t *state)
+{
+    for (unsigned i = 0; i < MAX_CARDINALITY; ++i) {
+        free(state->correct_at[i]);
+        state->correct_at[i] = NULL;
+    }
+}
+
+bool alloc_correct_at(state_t *state)
+{
+    state->correct_at_size = ((state->max_trials / 8) + 1) * sizeof(uint8_t);
+    memset(state->correct_at, 0, sizeof(state->correct_at));
+    for (unsigned i = 0; i < MAX_CARDINALITY; ++i) {
+        state->correct_at[i] = malloc(state->correct_at_size);
+        if (! state->correct_at[i]) {
+            free_correct_at(state);
+            return false;
+        }
+    }
+    return true;
+}
+
+void reset_state(state_t *state, uint64_t run)
+{
+    state->n_trials = 0;
+    // Ensure that seed2 is odd, as required by pcg library.
+    pcg32_srandom_r(&(state->rand_state), state->seed1, state->seed2 | 1);
+    if (state->partitioned)
+        pcg32_advance_r(&(state->rand_state), run * RUN_STREAM_STRIDE);
+
+    double *as = (double *)(state->assocs);
+    for (unsigned i = 0; i < sizeof(state->assocs)/sizeof(state->assocs[0][0]); ++i)
+        as[i] = 0.0;
+    double *cas = (double *)state->compound_cue_assocs;
+    for (unsigned i = 0; i < sizeof(state->compound_cue_assocs)/sizeof(state->compound_cue_assocs[0][0]); ++i)
+        cas[i] = 0.0;
+    for (unsigned i = 0; i < MAX_CARDINALITY; ++i) {
+        state->assoc_magnitude[i] = 0.0;
+        state->winning_marker[i] = -1;
+        // Forces the winners to be found after the first trial.
+        state->winning_margin[i] = 0.0;
+    }
+    memset(state->marker_has_been_correct_for_last, 0, sizeof(state->marker_has_been_correct_for_last));
+    state->all_markers_have_been_correct_for_last = 0;
+    state->stopped = false;
+    for (unsigned i = 0; i < MAX_CARDINALITY; ++i)
+        memset(state->correct_at[i], 0, state->correct_at_size);
+}
+
+// Determines the cardinality of a cue based on a random number.
+static uint_fast32_t cardinality_for(const state_t *state, uint32_t r)
+{
+    uint_fast32_t card;
+    for (card = 0; card < state->max_cue - 1 && r >= state->thresholds[card]; ++card);
+    return card;
+}
+
+// Updates the state for a cue of the given cardinality.
+static bool present_cue(state_t *state, uint_fast32_t card, int *marker_index)
+{
+    // Get the appropriate marker for that cardinality.
+    int mi = state->language.n_to_marker[card];
+    assert(mi >= 0);
+    *marker_index = mi;
+
+    if (! update_state(state, mi, card)) {
+        state->stopped = true;
+        return false;
+    }
+    ++(state->n_trials);
+    return true;
+}
+
+bool run_trial(state_t *state, uint_fast32_t *cardinality, int *marker_index)
+{
+    uint32_t r = pcg32_random_r(&(state->rand_state));
+    *cardinality = cardinality_for(state, r);
+    return present_cue(state, *cardinality, marker_index);
+}
+
+void run_trials(state_t *state, uint_fast64_t n)
+{
+    uint_fast32_t card;
+    int marker_index;
+    while (state->n_trials < n && run_trial(state, &card, &marker_index));
+}
+
+void run_trials_lockstep(state_t *const *states, size_t n_states, uint_fast64_t n)
+{
+    // All the states start with the same generator, so a single copy of it
+    // does for all of them.
+    pcg32_random_t rand_state = states[0]->rand_state;
+
+    size_t n_running = n_states;
+    for (uint_fast64_t t = states[0]->n_trials; t < n && n_running > 0; ++t) {
+        uint32_t r = pcg32_random_r(&rand_state);
+        uint_fast32_t card = cardinality_for(states[0], r);
+        for (size_t i = 0; i < n_states; ++i) {
+            int marker_index;
+            if (states[i]->stopped)
+                continue;
+            if (! present_cue(states[i], card, &marker_index)) {
+                // Leave the generator where it would have been had this state
+                // been run on its own.
+                states[i]->rand_state = rand_state;
+                --n_running;
+            }
+        }
+    }
+
+    for (size_t i = 0; i < n_states; ++i) {
+        if (! states[i]->stopped)
+            states[i]->rand_state = rand_state;
+    }
+}
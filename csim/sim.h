@@ -0,0 +1,98 @@
+#ifndef SIM_H
+#define SIM_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <config.h>
+#include <parser.h>
+#include <pcg_basic.h>
+#include <libnumbersim.h>
+
+// The library's ns_state_t. Nothing declared here is exported from it.
+typedef struct ns_state {
+    language_t language;
+    uint_fast64_t n_trials;
+    // Maximum number of trials in a run.
+    uint_fast64_t max_trials;
+    uint64_t seed1, seed2;
+    // If true, each run is a separate part of a partitioned stream.
+    bool partitioned;
+    uint_fast32_t max_cue;
+    double assocs[MAX_CARDINALITY][MAX_MARKERS];
+    // Only up to date after a call to compute_compound_cue_assocs().
+    double compound_cue_assocs[MAX_CARDINALITY][MAX_MARKERS];
+    // For each cardinality, the marker which would currently be produced (or
+    // -1 for none), and a lower bound on how far the compound cue
+    // associations must move before that could change.
+    int winning_marker[MAX_CARDINALITY];
+    double winning_margin[MAX_CARDINALITY];
+    // Upper bound on the absolute value of the associations in each row of
+    // assocs since the start of the run.
+    double assoc_magnitude[MAX_CARDINALITY];
+    double learning_rate;
+    uint32_t thresholds[MAX_CARDINALITY];
+    pcg32_random_t rand_state;
+    ns_output_mode_t output_mode;
+    uint_fast64_t marker_has_been_correct_for_last[MAX_CARDINALITY];
+    uint_fast64_t all_markers_have_been_correct_for_last;
+    // Array of bitfields for each cardinality.
+    uint8_t *correct_at[MAX_CARDINALITY];
+    // Size in bytes of each array in correct_at.
+    size_t correct_at_size;
+    unsigned quit_after_n_correct;
+    // Set if the current run has stopped early.
+    bool stopped;
+} state_t;
+
+// Sets the thresholds used to pick the cardinality of each cue from max_cue-1
+// p values. The leftover probability mass goes to the largest cardinality.
+void set_distribution(state_t *state, const double *ps);
+
+// Allocates (or frees) the correct_at bitfields for runs of up to
+// state->max_trials trials. Returns false if out of memory.
+bool alloc_correct_at(state_t *state);
+void free_correct_at(state_t *state);
+
+// Clears the results of any previous run and seeds the random number
+// generator. If state->partitioned is true, the generator is then advanced to
+// the start of the given run of the partitioned stream.
+void reset_state(state_t *state, uint64_t run);
+
+// Runs a single trial, storing the cardinality of the cue and the index of
+// its marker. Returns false (without counting the trial) if the run should
+// stop early.
+bool run_trial(state_t *state, uint_fast32_t *cardinality, int *marker_index);
+
+// Runs trials until there have been n or the run stops early.
+void run_trials(state_t *state, uint_fast64_t n);
+
+// Like run_trials(), but for several states which have the same random number
+// generator state, distribution and max_cue (but perhaps different languages
+// and learning rates). Each cue cardinality is drawn once and presented to
+// every state which has not stopped, giving the same results as running each
+// state on its own.
+void run_trials_lockstep(state_t *const *states, size_t n_states, uint_fast64_t n);
+
+// Brings compound_cue_assocs up to date. Trials don't do this, since they
+// only need the compound cue associations when the winning marker for a
+// cardinality might have changed.
+void compute_compound_cue_assocs(state_t *state);
+// The same, but writes the associations to 'out' rather than to the state.
+void get_compound_cue_assocs(const state_t *state, double out[MAX_CARDINALITY][MAX_MARKERS]);
+
+// A cardinality_index of max_cue means all cardinalities. Inline, since it's
+// called for every trial of every run when results are output.
+static inline bool was_correct_at(const state_t *state, unsigned cardinality_index, uint_fast64_t trial)
+{
+    if (cardinality_index < state->max_cue)
+        return (state->correct_at[cardinality_index][trial/8] >> (trial % 8)) & 1;
+
+    for (unsigned i = 0; i < state->max_cue; ++i) {
+        if (! ((state->correct_at[i][trial/8] >> (trial % 8)) & 1))
+            return false;
+    }
+    return true;
+}
+
+#endif
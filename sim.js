@@ -16,7 +16,11 @@ let options = {
     n_runs: 1000,
     seed1: parseInt(Math.random()*Math.pow(2,64)),
     seed2: parseInt(Math.random()*Math.pow(2,64)),
-    distribution: 'ztnbd'
+    distribution: 'ztnbd',
+    // If true, run i uses the ith run of a partitioned stream derived from
+    // seed1 and seed2 rather than continuing from the end of run i-1, so
+    // that runs can be split into shards without changing their results.
+    partition_streams: false
 };
 if (process.argv.length == 5) {
     try {
@@ -326,12 +330,18 @@ numbersim.stdout.on('data', (data) => {
     }
 });
 
+let numRuns = 0;
 doRun();
 function doRun(seed1, seed2) {
     progf.setupDistribution();
     let quitAfterN = 0;
     if (progf.getQuitAfterN)
         quitAfterN = progf.getQuitAfterN();
+    if (options.partition_streams) {
+        seed1 = options.seed1 + ':' + numRuns;
+        seed2 = options.seed2;
+    }
+    ++numRuns;
     let cmd = getInitialArgs(seed1 ? seed1 : options.seed1, seed2 ? seed2 : options.seed2, mode) + rd.join(' ') + '\n';
     //console.log("--->", cmd);
     numbersim.stdin.write(cmd, 'utf-8');